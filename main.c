@@ -13,9 +13,13 @@
 #include <time.h>
 #include <math.h>
 #include <stdbool.h>
+#include <emmintrin.h>
 
 #include <windows.h>
 
+#include <io.h>
+#include <malloc.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <gl/glew.h>
@@ -24,6 +28,7 @@
 #include "SDL2/SDL_opengl.h"
 
 #include "spng.h"
+#include "miniz.h"
 #include "gltext.h"
 
 
@@ -34,9 +39,17 @@ __declspec(dllexport) uint32_t NvOptimusEnablement = 1;
 __declspec(dllexport) int AmdPowerXpressRequestHighPerformance = 1;
 
 
+// exports report on stderr and exit with 1, their stdout may carry the
+// frame stream or progress lines and -j reads the exit code of workers
+static bool export_errors = false;
+// finishes a batch job still draining when setup of the next one fails
+static void (*bad_hook)(void) = NULL;
+static SDL_threadID bad_thread;
+
 void __bad(const char* msg, const char* error) {
-  printf("failed to %s : %s\n", msg, error);
-  exit(0);
+  fprintf(export_errors ? stderr : stdout, "failed to %s : %s\n", msg, error);
+  if (bad_hook && SDL_ThreadID() == bad_thread) bad_hook();
+  exit(export_errors ? 1 : 0);
 }
 
 
@@ -47,6 +60,8 @@ typedef struct offscreen_s {
   GLuint rb[2]; // ..
   GLuint tx[2]; // ..
   size_t wh[2]; // width,height
+  GLenum format; // of direct color target
+  bool depth;    // depth and stencil renderbuffer attached
 } offscreen_t;
 
 
@@ -98,8 +113,10 @@ typedef struct __program_set {
     struct { GLuint frag, comp; };
   };
   GLuint post;
+  GLuint quant; // export only, float -> 8 bit with dithering
   struct {
     GLuint id;
+    GLuint saved; // state a blurred export frame began with
     void* data;
     size_t item_size;
     size_t num_items;
@@ -107,16 +124,18 @@ typedef struct __program_set {
 } program_set_t;
 
 
-program_set_t pgset = { 0, 0, 0, {0, NULL, 0} };
+program_set_t pgset = { 0, 0, 0, 0, {0, 0, NULL, 0} };
 shape_t screen_quad;
 
 
 void dispose_program_set(program_set_t set) {
   if (set.frag) glDeleteProgram(set.frag);
   if (set.post) glDeleteProgram(set.post);
+  if (set.quant) glDeleteProgram(set.quant);
   if (set.comp) glDeleteProgram(set.comp);
   if (set.ssbo.data) free(set.ssbo.data);
   if (set.ssbo.id) glDeleteBuffers(1, &(set.ssbo.id));
+  if (set.ssbo.saved) glDeleteBuffers(1, &(set.ssbo.saved));
 }
 
 
@@ -124,10 +143,12 @@ void update_compute_buffer(program_set_t *set, size_t item_size, size_t num_item
   if (set->ssbo.item_size * set->ssbo.num_items != item_size * num_items) {
     if (set->ssbo.data) free(set->ssbo.data);
     if (set->ssbo.id) glDeleteBuffers(1, &(set->ssbo.id));
+    if (set->ssbo.saved) glDeleteBuffers(1, &(set->ssbo.saved));
+    set->ssbo.saved = 0;
     set->ssbo.data = malloc(item_size * num_items);
     glGenBuffers(1, &(set->ssbo.id));
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, set->ssbo.id);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, item_size * num_items, &(set->ssbo.data), GL_DYNAMIC_COPY);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, item_size * num_items, set->ssbo.data, GL_DYNAMIC_COPY);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
     set->ssbo.item_size = item_size;
     set->ssbo.num_items = num_items;
@@ -322,6 +343,73 @@ code_block_t load_shader_code(const char *path) {
   }
 }
 
+
+#define HASH_SEED 0xcbf29ce484222325ull
+
+// FNV-1a, identifies shader code and settings of an export
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t size) {
+  for (size_t n = 0; n < size; n++) {
+    hash = (hash ^ ((uint8_t*)data)[n]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// whole text file, NULL when it does not exist
+char* read_text(const char *path) {
+  FILE *fl = fopen(path, "rb");
+  if (fl == NULL) return NULL;
+  fseek(fl, 0, SEEK_END);
+  long size = ftell(fl);
+  fseek(fl, 0, SEEK_SET);
+  char *text = malloc(size + 1);
+  size = fread(text, 1, size, fl);
+  fclose(fl);
+  text[size] = 0;
+  return text;
+}
+
+bool crc_file(const char *path, uint32_t *crc, uint64_t *size) {
+  FILE *fl = fopen(path, "rb");
+  if (fl == NULL) return false;
+  uint8_t buffer[1 << 16];
+  size_t got;
+  *crc = MZ_CRC32_INIT;
+  *size = 0;
+  while ((got = fread(buffer, 1, sizeof(buffer), fl)) > 0) {
+    *crc = mz_crc32(*crc, buffer, got);
+    *size += got;
+  }
+  fclose(fl);
+  return true;
+}
+
+// true when file exists with given size and crc32
+bool check_file(const char *path, uint32_t crc, uint64_t size) {
+  uint32_t file_crc;
+  uint64_t file_size;
+  return crc_file(path, &file_crc, &file_size) && file_size == size && file_crc == crc;
+}
+
+// hardlink where the file system allows it, otherwise a copy that
+// appears under its name only once complete
+bool link_file(const char *from, const char *to) {
+  if (CreateHardLinkA(to, from, NULL)) return true;
+  char part[300];
+  snprintf(part, sizeof(part), "%s.part", to);
+  FILE *src = fopen(from, "rb"), *dst = src ? fopen(part, "wb") : NULL;
+  bool ok = dst != NULL;
+  uint8_t buffer[1 << 16];
+  size_t got;
+  while (ok && (got = fread(buffer, 1, sizeof(buffer), src)) > 0) {
+    ok = fwrite(buffer, 1, got, dst) == got;
+  }
+  if (src) fclose(src);
+  if (dst) ok = fclose(dst) == 0 && ok;
+  ok = ok && rename(part, to) == 0;
+  if (!ok) remove(part);
+  return ok;
+}
+
 // SHADER PROGRAM
 
 void dispose_shaders(GLuint prog, GLuint shader[]) {
@@ -398,16 +486,73 @@ GLuint create_program(const char** vert_s, const char** frag_s, const char** com
 
 // IMAGE TOOLS
 
-void flip_y_axis(void *dest, void *src, size_t height, size_t row_size) {
-  for (int n = 0; n < height; n++) {
-    memcpy(dest + row_size * n , src + row_size * (height - 1 - n), row_size);
+void put_be16(void *dst, uint16_t x) {
+  uint8_t *p = dst;
+  p[0] = x >> 8; p[1] = x;
+}
+
+void put_be32(void *dst, uint32_t x) {
+  uint8_t *p = dst;
+  p[0] = x >> 24; p[1] = x >> 16; p[2] = x >> 8; p[3] = x;
+}
+
+uint32_t get_be32(const void *src) {
+  const uint8_t *p = src;
+  return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// index of first differing byte, len if equal
+size_t first_diff(const uint8_t *a, const uint8_t *b, size_t len) {
+  size_t n = 0;
+  for (; n + 16 <= len; n += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(a + n));
+    __m128i y = _mm_loadu_si128((const __m128i*)(b + n));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+    if (mask != 0xFFFF) return n + __builtin_ctz(~mask);
   }
+  for (; n < len; n++) if (a[n] != b[n]) return n;
+  return len;
+}
+
+// one past the last differing byte, 0 if equal
+size_t last_diff(const uint8_t *a, const uint8_t *b, size_t len) {
+  size_t n = len;
+  for (; n >= 16; n -= 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(a + n - 16));
+    __m128i y = _mm_loadu_si128((const __m128i*)(b + n - 16));
+    int mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xFFFF;
+    if (mask) return n - 16 + (32 - __builtin_clz(mask));
+  }
+  for (; n > 0; n--) if (a[n - 1] != b[n - 1]) return n;
+  return 0;
 }
 
+// bounding box of changed pixels between two bottom-up images as top-down x,y,w,h
+bool diff_rect(const void *a, const void *b, int w, int h, size_t stride, int rect[4]) {
+  size_t bpp = stride / w;
+  size_t x0 = stride, x1 = 0;
+  int y0 = h, y1 = -1;
+  for (int row = 0; row < h; row++) {
+    const uint8_t *ra = a + stride * row, *rb = b + stride * row;
+    size_t first = first_diff(ra, rb, stride);
+    if (first == stride) continue;
+    size_t last = first + last_diff(ra + first, rb + first, stride - first);
+    if (first < x0) x0 = first;
+    if (last > x1) x1 = last;
+    if (row < y0) y0 = row;
+    y1 = row;
+  }
+  if (y1 < 0) return false;
+  rect[0] = x0 / bpp;
+  rect[1] = h - 1 - y1;
+  rect[2] = (x1 - 1) / bpp - rect[0] + 1;
+  rect[3] = y1 - y0 + 1;
+  return true;
+}
 
 // WINDOW
 
-SDL_Window* create_window(int width, int height) {
+SDL_Window* create_window(int width, int height, uint32_t flags, int swap_interval) {
   
   if(SDL_Init(SDL_INIT_VIDEO) < 0) 
     __bad("init SDL", SDL_GetError());
@@ -422,7 +567,7 @@ SDL_Window* create_window(int width, int height) {
   // SDL_GL_SetAttribute(SDL_GL_MULTISAMPLEBUFFERS, 1);
   // SDL_GL_SetAttribute(SDL_GL_MULTISAMPLESAMPLES, 4);
   
-  window = SDL_CreateWindow("shader-view", UNPOS, UNPOS, width, height, SDL_WINDOW_OPENGL);
+  window = SDL_CreateWindow("shader-view", UNPOS, UNPOS, width, height, SDL_WINDOW_OPENGL | flags);
   if (window == NULL) 
       __bad("create window", SDL_GetError());
   
@@ -435,7 +580,7 @@ SDL_Window* create_window(int width, int height) {
   
   if (glew_error != GLEW_OK)
     __bad("initialize glew", glewGetErrorString(glew_error));
-  if (SDL_GL_SetSwapInterval(1) < 0)
+  if (SDL_GL_SetSwapInterval(swap_interval) < 0)
     __bad("set vsync", SDL_GetError());
   
   //glEnable(GL_MULTISAMPLE);
@@ -448,8 +593,8 @@ void dispose_window(SDL_Window* window) {
 }
 
 
-offscreen_t create_offscreen(size_t w, size_t h) {
-  offscreen_t off = { .wh = {w, h} };
+offscreen_t create_offscreen(size_t w, size_t h, GLenum format, bool depth) {
+  offscreen_t off = { .wh = {w, h}, .format = format, .depth = depth };
   glGenFramebuffers(2, off.fb);
   glGenTextures(2, off.tx);
   glGenRenderbuffers(2, off.rb);
@@ -458,7 +603,7 @@ offscreen_t create_offscreen(size_t w, size_t h) {
   glBindFramebuffer(GL_FRAMEBUFFER, off.fb[0]);
   
   glBindTexture(GL_TEXTURE_2D, off.tx[0]);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, w, h, 0, GL_RGB, GL_FLOAT, NULL);
+  glTexImage2D(GL_TEXTURE_2D, 0, format, w, h, 0, format == GL_RGB32F ? GL_RGB : GL_RGBA, GL_FLOAT, NULL);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
@@ -466,10 +611,13 @@ offscreen_t create_offscreen(size_t w, size_t h) {
   glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, off.tx[0], 0);
   glBindTexture(GL_TEXTURE_2D, 0);
   
-  glBindRenderbuffer(GL_RENDERBUFFER, off.rb[0]);
-  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, w, h);
-  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, off.rb[0]);
-  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+  // a fullscreen quad never reads depth, it costs memory only when requested
+  if (depth) {
+    glBindRenderbuffer(GL_RENDERBUFFER, off.rb[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, w, h);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, off.rb[0]);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+  }
   
   if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
     __bad("create offscreen buffer", "");  
@@ -499,6 +647,21 @@ offscreen_t create_offscreen(size_t w, size_t h) {
   return off;
 } 
 
+// 8 bit target for quantized export, lives in the unused feedback slot
+void enable_quantize(offscreen_t off) {
+  glBindFramebuffer(GL_FRAMEBUFFER, off.fb[1]);
+  glBindTexture(GL_TEXTURE_2D, off.tx[1]);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, off.wh[0], off.wh[1], 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, off.tx[1], 0);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    __bad("create quantize buffer", "");
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
 void dispose_offscreen(offscreen_t off) {
   glDeleteTextures(2, off.tx);
   glDeleteRenderbuffers(2, off.rb);
@@ -506,7 +669,7 @@ void dispose_offscreen(offscreen_t off) {
 }
 
 
-void draw_content(offscreen_t off) {
+void compute_content() {
   // COMPUTE SHADER [OPTIONAL]
   if (pgset.comp) {
     glUseProgram(pgset.comp);
@@ -516,236 +679,2663 @@ void draw_content(offscreen_t off) {
     glDispatchCompute(pgset.ssbo.num_items / group_size[0] , group_size[1], group_size[2]);
     glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
   }
-  
+}
+
+void copy_compute(GLuint from, GLuint to) {
+  glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+  glBindBuffer(GL_COPY_READ_BUFFER, from);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, to);
+  glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, pgset.ssbo.item_size * pgset.ssbo.num_items);
+  glBindBuffer(GL_COPY_READ_BUFFER, 0);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+void save_compute() {
+  if (!pgset.comp || !pgset.ssbo.id) return;
+  if (!pgset.ssbo.saved) {
+    glGenBuffers(1, &(pgset.ssbo.saved));
+    glBindBuffer(GL_COPY_WRITE_BUFFER, pgset.ssbo.saved);
+    glBufferData(GL_COPY_WRITE_BUFFER, pgset.ssbo.item_size * pgset.ssbo.num_items, NULL, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+  }
+  copy_compute(pgset.ssbo.id, pgset.ssbo.saved);
+}
+
+void restore_compute() {
+  if (!pgset.comp || !pgset.ssbo.saved) return;
+  copy_compute(pgset.ssbo.saved, pgset.ssbo.id);
+}
+
+// a target drawn over completely is invalidated instead of cleared so its
+// old pixels are never touched, weighted passes add up and need the clear
+void clear_content(offscreen_t off, bool overwritten) {
+  glBindFramebuffer(GL_FRAMEBUFFER, off.fb[0]);
+  glViewport(0, 0, off.wh[0], off.wh[1]);
+  GLbitfield mask = off.depth ? GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT : 0;
+  if (overwritten) {
+    glInvalidateFramebuffer(GL_FRAMEBUFFER, 1, (GLenum[]){ GL_COLOR_ATTACHMENT0 });
+  } else {
+    mask |= GL_COLOR_BUFFER_BIT;
+  }
+  if (mask) glClear(mask);
+}
+
+// quad uv selects the part of the image drawn into offscreen, a weight
+// below 1 adds the weighted result to what is already there
+void shade_content(offscreen_t off, shape_t *quads, int num_quads, float weight) {
   // FRAGMENT SHADER
   glBindFramebuffer(GL_FRAMEBUFFER, off.fb[0]);
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-  draw_shape(screen_quad, pgset.frag, 0);
-  
+  if (weight < 1) {
+    glEnable(GL_BLEND);
+    glBlendColor(weight, weight, weight, weight);
+    glBlendFunc(GL_CONSTANT_COLOR, GL_ONE);
+  }
+  for (int n = 0; n < num_quads; n++) {
+    draw_shape(quads[n], pgset.frag, 0);
+  }
+  glDisable(GL_BLEND);
+}
+
+void quantize_content(offscreen_t off) {
+  // QUANTIZE SHADER [EXPORT]
+  if (pgset.quant) {
+    glBindFramebuffer(GL_FRAMEBUFFER, off.fb[1]);
+    glInvalidateFramebuffer(GL_FRAMEBUFFER, 1, (GLenum[]){ GL_COLOR_ATTACHMENT0 });
+    draw_shape(screen_quad, pgset.quant, off.tx[0]);
+  }
+}
+
+void render_content(offscreen_t off) {
+  compute_content();
+  clear_content(off, true);
+  shade_content(off, &screen_quad, 1, 1);
+  quantize_content(off);
+}
+
+void present_content(offscreen_t off) {
   // POSTPOROCESS SHADER
+  // window and offscreen sizes differ in sheets and batches
+  int w, h;
+  SDL_GL_GetDrawableSize(SDL_GL_GetCurrentWindow(), &w, &h);
   glBindFramebuffer(GL_FRAMEBUFFER, 0);
-  glClear(GL_COLOR_BUFFER_BIT);
+  glViewport(0, 0, w, h);
+  glInvalidateFramebuffer(GL_FRAMEBUFFER, 1, (GLenum[]){ GL_COLOR });
   draw_shape(screen_quad, pgset.post, off.tx[0]);
 }
 
+void draw_content(offscreen_t off) {
+  render_content(off);
+  present_content(off);
+}
 
-static const char* usage = 
-"shader-view: interactive preview for 2D fragment shaders.\n\n"
-"modes: \n\n"
-"shader-view -f shader.frag -- non interactive with hot-reload.\n"
-"shader-view -i -f shader.frag -- interactive with mouse and time input.\n"
-"shader-view -a N -f shader.frag -o name -- save one cycle of animation.\n\n"
-"other options: \n\n"
-"-x W,H   -- set window width and height (default 600,600).\n"
-"-d value -- delay in milliseconds between window updates (default 20).\n"
-"-a N     -- number of frames to save (remember time goes from 0.0 to 1.0).\n"
-"-o name  -- images saved as name_1.png name_2.png name_N.png.\n";
+// how an exported frame is drawn
+typedef struct exposure_s {
+  shape_t *quads;  // jittered quads, samples per band
+  int samples;     // ssaa x ssaa
+  int subframes;   // motion blur passes
+  float shutter;   // seconds covered by subframes
+} exposure_t;
+
+// an exported frame advances compute by one step at its own time whatever
+// --blur, --band or --sheet are, subframes of a blurred frame each step from
+// the state the frame began with and bands and cells shade from the same
+// steps, the frame is closed with the single step at its time
+void begin_exposure(exposure_t ex, float time) {
+  if (ex.subframes > 1) {
+    save_compute();
+    return;
+  }
+  broadcast_uniform1f(pgset, 0, time);
+  compute_content();
+}
 
-const char *bypass_vert =
-"#version 430 \n"
-"layout(location = 0) in vec3 pos; \n"
-"layout(location = 1) in vec3 tex; \n"
-"sample smooth out vec2 uv; \n"
-"void main() { gl_Position = vec4(pos, 1.); uv = tex.xy; } \n";
+void expose_subframe(exposure_t ex, float time, int k) {
+  broadcast_uniform1f(pgset, 0, time + ex.shutter * ((k + 0.5) / ex.subframes - 0.5));
+  if (ex.subframes > 1) {
+    restore_compute();
+    compute_content();
+  }
+}
 
-const char *post_frag =
-"#version 430 \n"
-"sample smooth in vec2 uv; \n"
-"out vec4 color; \n"
-"uniform sampler2D tex; \n"
-"layout(location = 0) uniform int mode;\n "
+void end_exposure(exposure_t ex, float time) {
+  if (ex.subframes > 1) {
+    restore_compute();
+    broadcast_uniform1f(pgset, 0, time);
+    compute_content();
+  }
+}
 
-"vec3 color_picker(vec2 uv) { \n"
-"  vec3 hsb = clamp(vec3(uv.x, uv.y, 1.), 0., 1.); \n"
-"  vec3 rgb = clamp(abs(mod(hsb.x*6.0+vec3(0.0,4.0,2.0),6.0)-3.0)-1.0, 0.0,1.0 ); \n"
-"  rgb = rgb*rgb*(3.0-2.0*rgb); \n"
-"  return hsb.z * mix(vec3(1.0), rgb, hsb.y); } \n"
+// subframes spread over the shutter interval around time and all jittered
+// quads are averaged into the cleared target
+void expose_content(offscreen_t off, exposure_t ex, int band, float time) {
+  for (int k = 0; k < ex.subframes; k++) {
+    expose_subframe(ex, time, k);
+    shade_content(off, ex.quads + band * ex.samples, ex.samples, 1. / (ex.samples * ex.subframes));
+  }
+}
 
-"void main() { \n"
-" vec2 ts = textureSize(tex, 0); \n"
-" vec2 pp = uv / max(vec2(1.0), (ts.xy / ts.yx)); \n"
-" vec4 cc = texture2D(tex, (pp + 1) * .5); \n"
-" switch(mode) { \n"
-"   case 0 : color = cc; break; \n"
-"   case 1 : color = vec4(vec3(cc.r), 1.); break; \n"
-"   case 2 : color = vec4(vec3(cc.g), 1.); break; \n"
-"   case 3 : color = vec4(vec3(cc.b), 1.); break; \n"
-"   case 4 : color = abs(cc); break; \n"
-"   case 5 : color = vec4(1 - cc.rgb, 1.); break; \n"
-"   case 6 : color = vec4(color_picker((pp + 1) * 0.5), 1.); } \n"
-"} \n";
+// one frame or band, averaged in the offscreen target before readback,
+// callers bracket the frame with begin_exposure and end_exposure
+void render_export(offscreen_t off, exposure_t ex, int band, float time) {
+  clear_content(off, ex.samples * ex.subframes == 1);
+  expose_content(off, ex, band, time);
+  quantize_content(off);
+}
+
+// export quads, uv of each covers the rows of one band shifted by one of
+// ssaa x ssaa sub-pixel offsets, samples of a band are consecutive
+shape_t* create_quads(int width, int height, int band, int num_bands, int ssaa) {
+  point_t a = scale_ndc((point_t){-1, 1, 0}, width, height);
+  point_t b = scale_ndc((point_t){1, -1, 0}, width, height);
+  float du = (b.u - a.u) / width, dv = (b.v - a.v) / height;
+  shape_t *quads = calloc(num_bands * ssaa * ssaa, sizeof(shape_t));
+  for (int n = 0; n < num_bands; n++) {
+    float top = a.v + dv * n * band;
+    float bottom = a.v + dv * (n + 1) * band;
+    for (int s = 0; s < ssaa * ssaa; s++) {
+      float jx = du * ((s % ssaa + 0.5) / ssaa - 0.5);
+      float jy = dv * ((s / ssaa + 0.5) / ssaa - 0.5);
+      quads[n * ssaa * ssaa + s] = gen_quad((point_t){-1, 1, 0}, (point_t){1, -1, 0},
+        (point_t){a.u + jx, top + jy, 0}, (point_t){b.u + jx, bottom + jy, 0});
+    }
+  }
+  return quads;
+}
+
+
+// SWEEP
+// one compiled program rendered over a grid of uniform values, every cell is
+// an exported image or a tile of one contact sheet, the first axis runs
+// along sheet rows and the second down its columns
+
+#define SWEEP_AXES 2
+
+typedef struct sweep_axis_s {
+  int location;
+  int component;   // 0 x, 1 y of a vec2 uniform, -1 float
+  float from, to;
+  int count;
+} sweep_axis_t;
+
+typedef struct sweep_s {
+  sweep_axis_t axes[SWEEP_AXES];
+  int num_axes;
+  int num_cells;
+  int columns, rows;  // of the contact sheet
+  int width, height;  // of one cell
+} sweep_t;
+
+
+// axes as location[x|y]=from:to:count separated by commas, e.g. 1x=-1:1:5,1y=-1:1:5
+sweep_t parse_sweep(const char *spec, int width, int height) {
+  sweep_t sw = { .num_cells = 1, .width = width, .height = height };
+  for (const char *p = spec; *p; ) {
+    sweep_axis_t ax = { .component = -1 };
+    int used = 0;
+    if (sw.num_axes == SWEEP_AXES || sscanf(p, "%d%n", &ax.location, &used) != 1)
+      __bad("set sweep", spec);
+    p += used;
+    if (*p == 'x' || *p == 'y') ax.component = *p++ - 'x';
+    if (sscanf(p, "=%f:%f:%d%n", &ax.from, &ax.to, &ax.count, &used) != 3 || ax.count < 1)
+      __bad("set sweep", spec);
+    if (ax.location == 0)
+      __bad("set sweep", "time is location 0, use --time");
+    p += used;
+    if (*p == ',') p++;
+    sw.axes[sw.num_axes++] = ax;
+    sw.num_cells *= ax.count;
+  }
+  if (sw.num_axes == 0)
+    __bad("set sweep", spec);
+  sw.columns = sw.axes[0].count;
+  sw.rows = sw.num_cells / sw.columns;
+  return sw;
+}
 
+void apply_sweep(sweep_t *sw, int cell) {
+  float values[SWEEP_AXES];
+  for (int a = 0; a < sw->num_axes; a++) {
+    sweep_axis_t ax = sw->axes[a];
+    int i = cell % ax.count;
+    cell /= ax.count;
+    values[a] = ax.count > 1 ? ax.from + (ax.to - ax.from) * i / (ax.count - 1) : ax.from;
+  }
+  for (int a = 0; a < sw->num_axes; a++) {
+    sweep_axis_t ax = sw->axes[a];
+    if (ax.component < 0) {
+      broadcast_uniform1f(pgset, ax.location, values[a]);
+      continue;
+    }
+    // components of one vec2 may come from both axes, the first one sets it
+    float v[2] = { 0, 0 };
+    bool first = true;
+    for (int b = 0; b < sw->num_axes; b++) {
+      if (sw->axes[b].location != ax.location || sw->axes[b].component < 0) continue;
+      v[sw->axes[b].component] = values[b];
+      first &= b >= a;
+    }
+    if (first) broadcast_uniform2f(pgset, ax.location, v[0], v[1]);
+  }
+}
 
+// every cell is drawn into its own tile of the sheet sized offscreen, the
+// sheet is quantized and read back once
+void render_sheet(offscreen_t off, exposure_t ex, sweep_t *sw, float time) {
+  // tiles cover the whole sheet, compute steps with the values of cell 0
+  clear_content(off, ex.samples * ex.subframes == 1);
+  apply_sweep(sw, 0);
+  begin_exposure(ex, time);
+  for (int k = 0; k < ex.subframes; k++) {
+    apply_sweep(sw, 0);
+    expose_subframe(ex, time, k);
+    for (int c = 0; c < sw->num_cells; c++) {
+      int column = c % sw->columns, row = c / sw->columns;
+      glViewport(column * sw->width, (sw->rows - 1 - row) * sw->height, sw->width, sw->height);
+      apply_sweep(sw, c);
+      shade_content(off, ex.quads, ex.samples, 1. / (ex.samples * ex.subframes));
+    }
+  }
+  apply_sweep(sw, 0);
+  end_exposure(ex, time);
+  glViewport(0, 0, off.wh[0], off.wh[1]);
+  quantize_content(off);
+}
 
 
+// READBACK
+// pixel pack buffers stay persistently mapped, once the fence of a slot
+// has passed its memory is handed to encoders without any copy
+
+#define READBACK_AHEAD 3 // frames rendered before the oldest one is waited on
+
+typedef struct readback_s {
+  GLuint *pbo;
+  GLsync *fence;
+  void **data;
+  int num_slots;
+  size_t size; // bytes per slot
+} readback_t;
+
+
+readback_t create_readback(int num_slots, size_t size) {
+  readback_t rb = { .num_slots = num_slots, .size = size };
+  rb.pbo = calloc(num_slots, sizeof(GLuint));
+  rb.fence = calloc(num_slots, sizeof(GLsync));
+  rb.data = calloc(num_slots, sizeof(void*));
+  GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+  glGenBuffers(num_slots, rb.pbo);
+  for (int n = 0; n < num_slots; n++) {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, rb.pbo[n]);
+    glBufferStorage(GL_PIXEL_PACK_BUFFER, size, NULL, flags | GL_CLIENT_STORAGE_BIT);
+    rb.data[n] = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, flags);
+    if (rb.data[n] == NULL)
+      __bad("map readback buffer", "");
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  return rb;
+}
 
-int argument_pos(int argc, char **argv, const char *arg) {
-  for (int n = 0; n < argc; n++) {
-    if (strcmp(argv[n], arg) == 0) return n;
+void dispose_readback(readback_t rb) {
+  for (int n = 0; n < rb.num_slots; n++) {
+    if (rb.fence[n]) glDeleteSync(rb.fence[n]);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, rb.pbo[n]);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
   }
-  return 0;
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  glDeleteBuffers(rb.num_slots, rb.pbo);
+  free(rb.pbo);
+  free(rb.fence);
+  free(rb.data);
 }
 
+// queue asynchronous copy of the bound read framebuffer into slot
+void readback_push(readback_t *rb, int slot, int w, int h, GLenum format, GLenum type) {
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, rb->pbo[slot]);
+  glReadPixels(0, 0, w, h, format, type, 0);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  rb->fence[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
 
-void copy_to_clipboard(const char* msg) {
-  size_t ml = strlen(msg);
-  void* clip = GlobalAlloc(GMEM_MOVEABLE | GMEM_DDESHARE, ml + 1);
-  void* clip_mem = GlobalLock(clip);
-  memcpy(clip_mem, msg, ml);
-  ((char*)clip_mem)[ml] = 0;
-  GlobalUnlock(clip);
-  
-  if (OpenClipboard(NULL)) {
-    EmptyClipboard();
-    SetClipboardData(CF_TEXT, clip);
-    CloseClipboard();
+// block until slot is filled, rows are bottom-up as GL wrote them
+void* readback_wait(readback_t *rb, int slot) {
+  GLenum state = GL_TIMEOUT_EXPIRED;
+  while (state == GL_TIMEOUT_EXPIRED) {
+    state = glClientWaitSync(rb->fence[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
   }
+  if (state == GL_WAIT_FAILED)
+    __bad("wait for readback", "fence failed");
+  glDeleteSync(rb->fence[slot]);
+  rb->fence[slot] = 0;
+  return rb->data[slot];
 }
 
 
+// TIMING
+// duration of each export stage per frame, GPU time comes from timer
+// queries read once the readback fence of the frame has passed
 
+enum export_stage { STAGE_RENDER, STAGE_READBACK, STAGE_ENCODE, STAGE_WRITE, NUM_STAGES };
 
-void update_info(GLTtext *info, int x, int y, GLuint fb, char* clipboard) {
-  float px[3] = {0};
-  char  xx[16 * 3] = {0};
-  char  sn[3];
-  glBindFramebuffer(GL_FRAMEBUFFER, fb);
-  glReadPixels(x, y, 1, 1, GL_RGB, GL_FLOAT, px);
-  glBindFramebuffer(GL_FRAMEBUFFER, 0);
-  for (int n = 0; n < 3; n++) { 
-    if (!isinf(px[n]) && !isnan(px[n])) {
-      sn[n] = px[n] >= 0 ? '+' : '-';
-      px[n] = fabs(px[n]);
-      sprintf(xx + 16 * n, "%1.3f", px[n]);
-    } else {
-      sn[n] = '?';
-      sprintf(xx + 16 * n, "%s", "?.???");
+typedef struct timing_s {
+  float *ms[NUM_STAGES]; // per frame, negative when not measured
+  int first, count;
+  GLuint *queries;       // one per readback slot
+  int num_queries;
+  uint64_t bytes;        // encoded output
+  uint64_t start;
+} timing_t;
+
+
+double elapsed_ms(uint64_t since) {
+  return (SDL_GetPerformanceCounter() - since) * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
+timing_t create_timing(int first, int count, int num_queries) {
+  timing_t t = { .first = first, .count = count, .num_queries = num_queries };
+  for (int s = 0; s < NUM_STAGES; s++) {
+    t.ms[s] = malloc(count * sizeof(float));
+    for (int n = 0; n < count; n++) t.ms[s][n] = -1;
+  }
+  t.queries = calloc(num_queries, sizeof(GLuint));
+  glGenQueries(num_queries, t.queries);
+  t.start = SDL_GetPerformanceCounter();
+  return t;
+}
+
+void dispose_timing(timing_t t) {
+  for (int s = 0; s < NUM_STAGES; s++) free(t.ms[s]);
+  glDeleteQueries(t.num_queries, t.queries);
+  free(t.queries);
+}
+
+// stages of one frame measured in parts (bands) are summed
+void timing_add(timing_t *t, int stage, int index, double ms) {
+  if (t == NULL || index < t->first || index >= t->first + t->count) return;
+  float *v = &(t->ms[stage][index - t->first]);
+  *v = (*v < 0 ? 0 : *v) + ms;
+}
+
+// GPU time of a slot once its fence has passed
+void timing_gpu(timing_t *t, int slot, int index) {
+  GLuint64 ns = 0;
+  glGetQueryObjectui64v(t->queries[slot], GL_QUERY_RESULT, &ns);
+  timing_add(t, STAGE_RENDER, index, ns / 1e6);
+}
+
+int compare_float(const void *a, const void *b) {
+  float x = *(const float*)a, y = *(const float*)b;
+  return (x > y) - (x < y);
+}
+
+// p50/p95/max per stage and throughput, as a table on stderr and optional json
+void report_timing(timing_t *t, const char *json_path) {
+  const char *names[] = { "render (gpu)", "readback", "encode", "write" };
+  const char *keys[] = { "render", "readback", "encode", "write" };
+  double seconds = elapsed_ms(t->start) / 1000;
+  int frames = 0;
+  for (int n = 0; n < t->count; n++) frames += t->ms[STAGE_RENDER][n] >= 0 || t->ms[STAGE_ENCODE][n] >= 0;
+  FILE *json = json_path ? fopen(json_path, "w") : NULL;
+  if (json_path && json == NULL)
+    __bad("write timing report", json_path);
+  if (json) fprintf(json, "{\n  \"stages\": {");
+  
+  fprintf(stderr, "%-14s%10s%10s%10s  (ms per frame)\n", "stage", "p50", "p95", "max");
+  float *sorted = malloc(t->count * sizeof(float));
+  for (int s = 0, listed = 0; s < NUM_STAGES; s++) {
+    int count = 0;
+    for (int n = 0; n < t->count; n++) {
+      if (t->ms[s][n] >= 0) sorted[count++] = t->ms[s][n];
     }
+    if (count == 0) continue;
+    qsort(sorted, count, sizeof(float), compare_float);
+    float p50 = sorted[(count - 1) / 2], p95 = sorted[(count - 1) * 95 / 100], max = sorted[count - 1];
+    fprintf(stderr, "%-14s%10.2f%10.2f%10.2f\n", names[s], p50, p95, max);
+    if (json) fprintf(json, "%s\n    \"%s\": { \"p50\": %.3f, \"p95\": %.3f, \"max\": %.3f }", listed++ ? "," : "", keys[s], p50, p95, max);
   }
-  if (clipboard) {
-   memset(clipboard, 0, strlen(clipboard)); 
-   sprintf(clipboard, "vec4(%.5s, %.5s, %.5s, 1.0)", xx, xx+16, xx+32); 
+  free(sorted);
+  
+  double fps = frames / seconds, mbps = t->bytes / seconds / (1 << 20);
+  fprintf(stderr, "%d frames in %.2f s, %.2f fps, %.2f MB/s\n", frames, seconds, fps, mbps);
+  if (json) {
+    fprintf(json, "\n  },\n  \"frames\": %d,\n  \"seconds\": %.3f,\n  \"fps\": %.3f,\n  \"mb_per_s\": %.3f\n}\n", frames, seconds, fps, mbps);
+    fclose(json);
   }
-  sprintf(info->_text, "INFO/R%c%.5s/G%c%.5s/B%c%.5s", 
-    sn[0], xx, sn[1], xx+16, sn[2], xx+32);
-  info->_dirty = GL_TRUE;
 }
 
 
-//////////////////////////////////////////////////////////////////
+// EXPORT PIPELINE
+// GL thread -> encode queue -> encoder threads -> write queue -> ordered writer
+
+typedef struct frame_s {
+  int index;
+  int slot;         // readback slot owning pixels
+  void *pixels;     // bottom-up rows, mapped readback memory
+  size_t pixels_size;
+  void *data;       // encoded file
+  size_t data_size;
+  size_t data_cap;
+  int rect[4];      // x,y,w,h of encoded region, top-down
+  int same;         // earlier frame with identical pixels, -1 if none
+  uint32_t crc;     // of encoded file, for the manifest
+  struct frame_s *prev; // predecessor for delta formats, held until encoded
+  SDL_atomic_t refs;
+} frame_t;
+
+
+typedef struct queue_s {
+  frame_t **items;
+  int cap, head, count;
+  bool closed;
+  SDL_mutex *lock;
+  SDL_cond *not_empty;
+  SDL_cond *not_full;
+} queue_t;
+
+
+queue_t create_queue(int cap) {
+  queue_t q = { .cap = cap };
+  q.items = calloc(cap, sizeof(frame_t*));
+  q.lock = SDL_CreateMutex();
+  q.not_empty = SDL_CreateCond();
+  q.not_full = SDL_CreateCond();
+  return q;
+}
 
-int main(int argc, char **argv) {
-  if (argument_pos(argc, argv, "-h") > 0) {
-    printf("%s", usage);
-    return 0;
+void dispose_queue(queue_t q) {
+  free(q.items);
+  SDL_DestroyMutex(q.lock);
+  SDL_DestroyCond(q.not_empty);
+  SDL_DestroyCond(q.not_full);
+}
+
+void queue_push(queue_t *q, frame_t *f) {
+  SDL_LockMutex(q->lock);
+  while (q->count == q->cap) SDL_CondWait(q->not_full, q->lock);
+  q->items[(q->head + q->count) % q->cap] = f;
+  q->count++;
+  SDL_CondSignal(q->not_empty);
+  SDL_UnlockMutex(q->lock);
+}
+
+// blocks until item is available, NULL when queue is closed and drained
+frame_t* queue_pop(queue_t *q) {
+  frame_t *f = NULL;
+  SDL_LockMutex(q->lock);
+  while (q->count == 0 && !q->closed) SDL_CondWait(q->not_empty, q->lock);
+  if (q->count > 0) {
+    f = q->items[q->head];
+    q->head = (q->head + 1) % q->cap;
+    q->count--;
+    SDL_CondSignal(q->not_full);
   }
-  int shader_path = argument_pos(argc, argv, "-f");
-  if (shader_path > 0) {
-    shader_path += 1;  
+  SDL_UnlockMutex(q->lock);
+  return f;
+}
+
+void queue_close(queue_t *q) {
+  SDL_LockMutex(q->lock);
+  q->closed = true;
+  SDL_CondBroadcast(q->not_empty);
+  SDL_UnlockMutex(q->lock);
+}
+
+// back to the pool once writer and successor are both done with it
+void frame_release(frame_t *f, queue_t *pool) {
+  if (SDL_AtomicDecRef(&(f->refs))) queue_push(pool, f);
+}
+
+
+// ARENA
+// per-thread bump allocator behind spng contexts and encoder scratch, all
+// memory of one encode is freed together so the arena rewinds whenever no
+// block is live and grows to the peak it has seen, after the first frame
+// encoders stop touching the heap
+
+#define ARENA_ALIGN 16
+
+typedef struct arena_s {
+  uint8_t *base;
+  size_t size;
+  size_t used;
+  size_t demand;  // bytes requested since last rewind, heap fallback included
+  int live;       // blocks handed out from base
+  int spilled;    // live blocks that did not fit
+} arena_t;
+
+static _Thread_local arena_t arena;
+
+// blocks carry their size in front so realloc can copy them
+void* arena_alloc(size_t size) {
+  size_t need = ARENA_ALIGN + (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+  arena.demand += need;
+  uint8_t *block;
+  if (arena.used + need <= arena.size) {
+    block = arena.base + arena.used;
+    arena.used += need;
+    arena.live++;
   } else {
-    __bad("get shader path", "use -h for help");
+    block = malloc(need); // only until next rewind makes room
+    if (block == NULL) return NULL;
+    arena.spilled++;
   }
-  
-  int width = 600, height = 600, delay = 20;
-  int size_arg = argument_pos(argc, argv, "-x");
-  if (size_arg > 0) {
-    sscanf(argv[size_arg + 1], "%d,%d", &width, &height);
+  *(size_t*)block = size;
+  return block + ARENA_ALIGN;
+}
+
+bool arena_owns(void *ptr) {
+  return (uint8_t*)ptr >= arena.base && (uint8_t*)ptr < arena.base + arena.size;
+}
+
+void arena_free(void *ptr) {
+  if (ptr == NULL) return;
+  if (arena_owns(ptr)) {
+    arena.live--;
+  } else {
+    free((uint8_t*)ptr - ARENA_ALIGN);
+    arena.spilled--;
   }
-  int delay_arg = argument_pos(argc, argv, "-d");
-  if (delay_arg > 0) {
-    sscanf(argv[delay_arg + 1], "%d", &delay);
+  if (arena.live > 0 || arena.spilled > 0) return;
+  arena.used = 0;
+  if (arena.demand > arena.size) {
+    free(arena.base);
+    arena.size = arena.demand;
+    arena.base = malloc(arena.size);
+    if (arena.base == NULL) arena.size = 0;
   }
-  
-  
-  SDL_Window* window = create_window(width, height);
-  offscreen_t offscr = create_offscreen(width, height);
-  screen_quad = gen_quad(  
-    (point_t){-1, 1, 0}, 
-    (point_t){1, -1, 0}, 
-    scale_ndc((point_t){-1, 1, 0}, width, height), 
-    scale_ndc((point_t){1, -1, 0}, width, height));
+  arena.demand = 0;
+}
 
-  pgset.post = create_program(&bypass_vert, &post_frag, NULL);
-  
-  // ANIMATION BATCH //
+void* arena_realloc(void *ptr, size_t size) {
+  if (ptr == NULL) return arena_alloc(size);
+  size_t old = *(size_t*)((uint8_t*)ptr - ARENA_ALIGN);
+  // the newest block grows in place
+  size_t old_end = (old + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+  size_t new_end = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+  if (arena_owns(ptr) && (uint8_t*)ptr + old_end == arena.base + arena.used &&
+      new_end >= old_end && arena.used + new_end - old_end <= arena.size) {
+    arena.used += new_end - old_end;
+    arena.demand += new_end - old_end;
+    *(size_t*)((uint8_t*)ptr - ARENA_ALIGN) = size;
+    return ptr;
+  }
+  void *copy = arena_alloc(size);
+  if (copy == NULL) return NULL;
+  memcpy(copy, ptr, old < size ? old : size);
+  arena_free(ptr);
+  return copy;
+}
 
-  int anim_arg = argument_pos(argc, argv, "-a");
-  if (anim_arg > 0) {
-    int out_arg = argument_pos(argc, argv, "-o");
-    if (out_arg > 0) {
-      
-      int anim_fps, num_frames;
-      float duration;
-      sscanf(argv[anim_arg + 1], "%d,%f", &anim_fps, &duration);
-      num_frames = floor(anim_fps * duration);
-      code_block_t cblock = load_shader_code(argv[shader_path]);
-      if (cblock.comp) {
-        pgset.comp = create_program(NULL, NULL, (const char**)&(cblock.comp));
-      }
-      pgset.frag = create_program(&bypass_vert, (const char**)&(cblock.frag), NULL);
-      glProgramUniform2i(pgset.frag, 3, width, height);
-      
-      struct spng_ihdr ihdr = {
-        .color_type = SPNG_COLOR_TYPE_TRUECOLOR_ALPHA,
-        .height = height,
-        .width = width,
-        .bit_depth = 16,
-      };
-      
-      float delta = duration / (num_frames-1);
-      FILE* out_file[num_frames];
-      size_t img_size = width * height * 4;
-      
-      uint16_t *frame_buf = malloc(sizeof(uint16_t) * img_size);
-      uint16_t *flipped_buf = malloc(sizeof(uint16_t) * img_size);
-      
-      char out_name[128] = {0};
-      char out_path[128] = {0};
-      
-      split_path(argv[out_arg + 1], out_path, out_name);
-      if (strlen(out_path) > 0) drill_path(out_path);
-      
-      printf("start animation rendering\n");
-          
-      for (int n = 0; n < num_frames; n++) { 
-        spng_ctx *enc = spng_ctx_new(SPNG_CTX_ENCODER);
-        
-        char out_join[128] = {0};
-        sprintf(out_join, "%s/%s_%d.png", out_path, out_name, n);
-        out_file[n] = fopen(out_join, "wb");
-        
-        if (out_file[n] != NULL) {
-          spng_set_png_file(enc, out_file[n]);
-          spng_set_ihdr(enc, &ihdr);
-          
-          broadcast_uniform1f(pgset, 0, delta * n);
-          draw_content(offscr);
-          glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_SHORT, frame_buf);
-          SDL_GL_SwapWindow(window);
-          
-          flip_y_axis(flipped_buf, frame_buf, height, sizeof(uint16_t) * width * 4);
-          spng_encode_image(enc, flipped_buf, sizeof(uint16_t) * img_size, SPNG_FMT_PNG, SPNG_ENCODE_FINALIZE);
-        
-        } else {
-          __bad("write output file", out_join);
-        }  
-        spng_ctx_free(enc);
+void* arena_calloc(size_t count, size_t size) {
+  void *ptr = arena_alloc(count * size);
+  if (ptr) memset(ptr, 0, count * size);
+  return ptr;
+}
+
+// called by threads on exit, blocks must not be live
+void dispose_arena(void) {
+  free(arena.base);
+  arena = (arena_t){0};
+}
+
+spng_ctx* create_encoder(void) {
+  struct spng_alloc alloc = { arena_alloc, arena_realloc, arena_calloc, arena_free };
+  return spng_ctx_new2(&alloc, SPNG_CTX_ENCODER);
+}
+
+
+// TASK POOL
+// splits one frame into independent pieces (EXR chunks, PNG row groups), the submitting
+// encoder works on its own batch as well so a busy pool never stalls it
+
+typedef struct batch_s {
+  void (*run)(void *user, int item);
+  void *user;
+  int count;
+  int next;      // next unclaimed item
+  int finished;
+  struct batch_s *link;
+} batch_t;
+
+
+typedef struct tasks_s {
+  batch_t *batches;  // open batches, newest first
+  bool closed;
+  SDL_mutex *lock;
+  SDL_cond *wake;
+  SDL_cond *done;
+  SDL_Thread **threads;
+  int num_threads;
+} tasks_t;
+
+
+// claims one item of any open batch, called with lock held
+batch_t* tasks_claim(tasks_t *t, int *item) {
+  for (batch_t *b = t->batches; b; b = b->link) {
+    if (b->next < b->count) {
+      *item = b->next++;
+      return b;
+    }
+  }
+  return NULL;
+}
+
+// runs claimed item outside of lock, called with lock held
+void tasks_execute(tasks_t *t, batch_t *b, int item) {
+  SDL_UnlockMutex(t->lock);
+  b->run(b->user, item);
+  SDL_LockMutex(t->lock);
+  if (++b->finished == b->count) SDL_CondBroadcast(t->done);
+}
+
+int task_thread(void *user) {
+  tasks_t *t = user;
+  SDL_LockMutex(t->lock);
+  while (true) {
+    int item;
+    batch_t *b = tasks_claim(t, &item);
+    if (b) {
+      tasks_execute(t, b, item);
+    } else if (t->closed) {
+      break;
+    } else {
+      SDL_CondWait(t->wake, t->lock);
+    }
+  }
+  SDL_UnlockMutex(t->lock);
+  dispose_arena();
+  return 0;
+}
+
+tasks_t create_tasks(int num_threads) {
+  tasks_t t = { .num_threads = num_threads };
+  t.lock = SDL_CreateMutex();
+  t.wake = SDL_CreateCond();
+  t.done = SDL_CreateCond();
+  t.threads = calloc(num_threads, sizeof(SDL_Thread*));
+  return t;
+}
+
+// threads get the final address of the pool
+void start_tasks(tasks_t *t) {
+  for (int n = 0; n < t->num_threads; n++) {
+    t->threads[n] = SDL_CreateThread(task_thread, "task", t);
+  }
+}
+
+void dispose_tasks(tasks_t *t) {
+  SDL_LockMutex(t->lock);
+  t->closed = true;
+  SDL_CondBroadcast(t->wake);
+  SDL_UnlockMutex(t->lock);
+  for (int n = 0; n < t->num_threads; n++) {
+    if (t->threads[n]) SDL_WaitThread(t->threads[n], NULL);
+  }
+  free(t->threads);
+  SDL_DestroyMutex(t->lock);
+  SDL_DestroyCond(t->wake);
+  SDL_DestroyCond(t->done);
+}
+
+// calls run(user, 0..count-1) in parallel, returns when all items are done
+void tasks_run(tasks_t *t, void (*run)(void*, int), void *user, int count) {
+  batch_t batch = { run, user, count };
+  SDL_LockMutex(t->lock);
+  batch.link = t->batches;
+  t->batches = &batch;
+  SDL_CondBroadcast(t->wake);
+  while (batch.next < batch.count) {
+    tasks_execute(t, &batch, batch.next++);
+  }
+  while (batch.finished < batch.count) SDL_CondWait(t->done, t->lock);
+  batch_t **b = &t->batches;
+  while (*b != &batch) b = &(*b)->link;
+  *b = batch.link;
+  SDL_UnlockMutex(t->lock);
+}
+
+
+// FRAME OUTPUT
+// encoded frames are committed strictly by index, each file is opened,
+// written and closed at once so neither fds nor memory grow with length,
+// stream formats go to one file, named pipe or stdout (-o -)
+
+enum output_format { OUTPUT_PNG, OUTPUT_Y4M, OUTPUT_PAM, OUTPUT_APNG, OUTPUT_EXR };
+
+#define APNG_CHUNK (1 << 24) // max payload of one IDAT/fdAT chunk
+#define EXR_LINES 16         // scanlines per ZIP compressed EXR chunk
+
+enum png_speed { PNG_BALANCED, PNG_DRAFT, PNG_ARCHIVE };
+
+// overlapped write of one per-frame file, the completion hands back the op
+typedef struct write_op_s {
+  OVERLAPPED ov;
+  HANDLE file;
+  frame_t *f;
+  queue_t *recycle;
+  uint32_t crc;
+  uint64_t size;
+  bool direct;       // unbuffered, padded to whole sectors
+} write_op_t;
+
+typedef struct output_s {
+  int format;
+  char path[128];
+  char name[128];
+  FILE *stream;      // stream formats only
+  mz_zip_archive *zip; // per-frame formats written to -o name.zip
+  struct spng_ihdr ihdr;
+  int fps;
+  int png_speed;
+  uint32_t sequence; // APNG chunk sequence
+  int written;
+  FILE *progress;    // frame counter for a parent process
+  timing_t *timing;
+  FILE *manifest;    // per-frame formats, one line per written file
+  uint64_t hash;     // shader and export settings
+  float delta;
+  bool *present;     // valid files of an earlier run, never rendered again
+  char cache[128];   // directory of encoded frames shared by all exports
+  uint64_t cache_hash; // shader and settings that change pixels, time is added per frame
+  size_t stride;     // bytes per readback row
+  frame_t **pending; // reorder window, frames waiting for predecessors
+  int window;
+  int next;
+  SDL_mutex *lock;
+  HANDLE port;       // completion port of overlapped file writes, -w 2
+  SDL_Thread *reaper;
+  write_op_t *ops;   // one per readback slot
+  int in_flight;
+  SDL_mutex *io_lock; // in_flight and reaper side of manifest and cache
+  SDL_cond *drained;
+  size_t direct_min; // frames this large skip the system cache, 0 never
+} output_t;
+
+
+void output_write(output_t *out, const void *data, size_t size) {
+  if (fwrite(data, 1, size, out->stream) != size)
+    __bad("write output stream", "");
+}
+
+// sequenced chunks (fdAT) carry the sequence number in front of data
+void output_chunk(output_t *out, const char *type, const void *data, size_t size, bool sequenced) {
+  uint8_t head[12], tail[4];
+  size_t head_size = sequenced ? 12 : 8;
+  put_be32(head, size + head_size - 8);
+  memcpy(head + 4, type, 4);
+  if (sequenced) put_be32(head + 8, out->sequence++);
+  uint32_t crc = mz_crc32(MZ_CRC32_INIT, head + 4, head_size - 4);
+  if (size) crc = mz_crc32(crc, data, size);
+  put_be32(tail, crc);
+  output_write(out, head, head_size);
+  output_write(out, data, size);
+  output_write(out, tail, 4);
+}
+
+output_t open_output(const char *target, int format, struct spng_ihdr ihdr, int fps, int num_frames, int window) {
+  output_t out = { .format = format, .ihdr = ihdr, .fps = fps, .window = window };
+  out.stride = ihdr.bit_depth / 8 * 4 * ihdr.width;
+  if (format == OUTPUT_PNG || format == OUTPUT_EXR) {
+    split_path(target, out.path, out.name);
+    if (strlen(out.path) > 0) drill_path(out.path);
+    char *ext = strrchr(out.name, '.');
+    if (ext && strcmp(ext, ".zip") == 0) {
+      // frames are STOREd, zip64 records are added once the archive needs them
+      *ext = 0;
+      out.zip = calloc(1, sizeof(mz_zip_archive));
+      if (!mz_zip_writer_init_file(out.zip, target, 0))
+        __bad("open output archive", target);
+    }
+  } else {
+    if (strcmp(target, "-") == 0) {
+      _setmode(_fileno(stdout), _O_BINARY);
+      out.stream = stdout;
+    } else {
+      out.stream = fopen(target, "wb");
+    }
+    if (out.stream == NULL)
+      __bad("open output stream", target);
+    if (format == OUTPUT_Y4M) {
+      fprintf(out.stream, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 %s\n",
+        ihdr.width, ihdr.height, fps, ihdr.bit_depth == 16 ? "C444p16" : "C444");
+    }
+    if (format == OUTPUT_APNG) {
+      uint8_t head[13], actl[8];
+      put_be32(head, ihdr.width);
+      put_be32(head + 4, ihdr.height);
+      memcpy(head + 8, (uint8_t[]){ ihdr.bit_depth, ihdr.color_type, 0, 0, 0 }, 5);
+      put_be32(actl, num_frames);
+      put_be32(actl + 4, 0); // loop forever
+      output_write(&out, "\x89PNG\r\n\x1a\n", 8);
+      output_chunk(&out, "IHDR", head, 13, false);
+      output_chunk(&out, "acTL", actl, 8, false);
+    }
+  }
+  out.pending = calloc(window, sizeof(frame_t*));
+  out.lock = SDL_CreateMutex();
+  return out;
+}
+
+void close_output(output_t out) {
+  if (out.format == OUTPUT_APNG) {
+    output_chunk(&out, "IEND", NULL, 0, false);
+  }
+  if (out.zip) {
+    if (!mz_zip_writer_finalize_archive(out.zip))
+      __bad("write output archive", mz_zip_get_error_string(mz_zip_get_last_error(out.zip)));
+    mz_zip_writer_end(out.zip);
+    free(out.zip);
+  }
+  if (out.stream) {
+    if (fflush(out.stream) != 0)
+      __bad("write output stream", "flush failed");
+    if (out.stream != stdout) fclose(out.stream);
+  }
+  if (out.port) {
+    PostQueuedCompletionStatus(out.port, 0, 0, NULL);
+    SDL_WaitThread(out.reaper, NULL);
+    CloseHandle(out.port);
+    free(out.ops);
+    SDL_DestroyMutex(out.io_lock);
+    SDL_DestroyCond(out.drained);
+  }
+  if (out.manifest) fclose(out.manifest);
+  free(out.present);
+  free(out.pending);
+  SDL_DestroyMutex(out.lock);
+}
+
+void frame_path(output_t *out, int index, char *path) {
+  sprintf(path, "%s/%s_%d.%s", out->path, out->name, index, out->format == OUTPUT_EXR ? "exr" : "png");
+}
+
+// shard workers keep their own list, merged by the parent
+void manifest_path(const char *path, const char *name, int shard, char *file) {
+  if (shard < 0) sprintf(file, "%s/%s.manifest", path, name);
+  else sprintf(file, "%s/%s.manifest.%d", path, name, shard);
+}
+
+// lines are "index time hash crc size", frames in first..last-1 listed with
+// the same hash and an intact file are marked present, others are dropped
+void open_manifest(output_t *out, uint64_t hash, float delta, int num_frames, int first, int last, int shard) {
+  out->hash = hash;
+  out->delta = delta;
+  out->present = calloc(num_frames + 1, sizeof(bool));
+  char file[300], frame[300];
+  char *text[2] = { NULL, NULL };
+  manifest_path(out->path, out->name, -1, file);
+  text[0] = read_text(file);
+  if (shard >= 0) {
+    manifest_path(out->path, out->name, shard, file);
+    text[1] = read_text(file);
+  }
+  out->manifest = fopen(file, "wb");
+  if (out->manifest == NULL)
+    __bad("write manifest", file);
+  // merge replaces this range of the main list with the shard list
+  if (shard >= 0) fprintf(out->manifest, "range %d %d\n", first, last);
+  
+  for (int n = 0; n < 2; n++) {
+    for (char *line = text[n]; line && *line; ) {
+      char *end = strchr(line, '\n');
+      if (end) *end = 0;
+      int index;
+      float time;
+      unsigned long long line_hash, size;
+      unsigned crc;
+      if (sscanf(line, "%d %f %llx %x %llu", &index, &time, &line_hash, &crc, &size) == 5 && index < num_frames) {
+        bool keep = shard < 0; // main list outlives ranges of other runs
+        if (index >= first && index < last) {
+          keep = false;
+          if (line_hash == hash && !out->present[index]) {
+            frame_path(out, index, frame);
+            keep = out->present[index] = check_file(frame, crc, size);
+          }
+        }
+        if (keep) fprintf(out->manifest, "%s\n", line);
+      }
+      line = end ? end + 1 : "";
+    }
+    free(text[n]);
+  }
+  fflush(out->manifest);
+}
+
+// shard lists go back to the main one once all workers are done
+// lines of the main list inside a shard range are replaced by the shard
+// list, a shard that left no list keeps its part of the main list
+void merge_manifests(const char *path, const char *name, int num_shards) {
+  char file[300];
+  char **text = calloc(num_shards, sizeof(char*));
+  int *ranges = calloc(num_shards * 2, sizeof(int));
+  for (int n = 0; n < num_shards; n++) {
+    manifest_path(path, name, n, file);
+    text[n] = read_text(file);
+    if (text[n]) sscanf(text[n], "range %d %d", ranges + n * 2, ranges + n * 2 + 1);
+  }
+  manifest_path(path, name, -1, file);
+  char *main_text = read_text(file);
+  FILE *merged = fopen(file, "wb");
+  for (char *line = main_text; merged && line && *line; ) {
+    char *end = strchr(line, '\n');
+    if (end) *end = 0;
+    int index, n = 0;
+    if (sscanf(line, "%d", &index) == 1) {
+      while (n < num_shards && (index < ranges[n * 2] || index >= ranges[n * 2 + 1])) n++;
+    }
+    if (n == num_shards) fprintf(merged, "%s\n", line);
+    line = end ? end + 1 : "";
+  }
+  for (int n = 0; n < num_shards; n++) {
+    if (text[n] == NULL) continue;
+    if (merged) {
+      char *lines = text[n];
+      if (strncmp(lines, "range ", 6) == 0) lines = strchr(lines, '\n') ? strchr(lines, '\n') + 1 : "";
+      fputs(lines, merged);
+    }
+    manifest_path(path, name, n, file);
+    if (merged) remove(file);
+    free(text[n]);
+  }
+  if (merged) fclose(merged);
+  free(main_text);
+  free(ranges);
+  free(text);
+}
+
+void manifest_add(output_t *out, int index, uint32_t crc, uint64_t size) {
+  fprintf(out->manifest, "%d %.9g %016llx %08x %llu\n", index, out->delta * index,
+    (unsigned long long)out->hash, crc, (unsigned long long)size);
+  fflush(out->manifest);
+}
+
+void cache_path(output_t *out, int index, char *file) {
+  float time = out->delta * index;
+  uint64_t key = hash_bytes(out->cache_hash, &time, sizeof(time));
+  sprintf(file, "%s/%016llx.%s", out->cache, (unsigned long long)key, out->format == OUTPUT_EXR ? "exr" : "png");
+}
+
+// frame from cache becomes present like one of an earlier run
+bool output_restore(output_t *out, int index) {
+  char file[300], frame[300];
+  uint32_t crc;
+  uint64_t size;
+  cache_path(out, index, file);
+  frame_path(out, index, frame);
+  if (!crc_file(file, &crc, &size)) return false;
+  remove(frame);
+  if (!link_file(file, frame)) return false;
+  manifest_add(out, index, crc, size);
+  return out->present[index] = true;
+}
+
+// bookkeeping once a frame file is complete on disk
+void output_written(output_t *out, int index, uint32_t crc, uint64_t size) {
+  if (out->manifest) manifest_add(out, index, crc, size);
+  if (out->cache[0]) {
+    char file[300], cache_file[300];
+    frame_path(out, index, file);
+    cache_path(out, index, cache_file);
+    if (access(cache_file, 0) != 0) link_file(file, cache_file);
+  }
+}
+
+// previous frame when its pixels are identical byte for byte, -1 when this
+// one owns its content, the previous frame is committed first so its file
+// can be linked
+int output_same(output_t *out, frame_t *f) {
+  if (out->format == OUTPUT_APNG || f->prev == NULL) return -1;
+  return memcmp(f->prev->pixels, f->pixels, out->stride * out->ihdr.height) ? -1 : f->prev->index;
+}
+
+// frames already on disk are not waited for
+void output_skip(output_t *out) {
+  while (out->present && out->present[out->next]) out->next++;
+}
+
+// files of -w 2 are written with overlapped I/O, commit only queues the write
+// and the reaper finishes the file once it lands, the frame stays referenced
+// until then so readback slots bound the writes in flight
+
+#define SECTOR_SIZE 4096 // unbuffered writes are aligned to it, covers 512e and 4Kn disks
+
+int reaper_thread(void *user) {
+  output_t *out = user;
+  DWORD bytes;
+  ULONG_PTR key;
+  OVERLAPPED *ov;
+  while (true) {
+    BOOL ok = GetQueuedCompletionStatus(out->port, &bytes, &key, &ov, INFINITE);
+    if (ov == NULL) break; // posted by close_output
+    write_op_t *op = (write_op_t*)ov;
+    if (!ok || bytes < op->size)
+      __bad("write output file", "overlapped write failed");
+    if (op->direct) {
+      FILE_END_OF_FILE_INFO end = { .EndOfFile.QuadPart = op->size };
+      if (!SetFileInformationByHandle(op->file, FileEndOfFileInfo, &end, sizeof(end)))
+        __bad("write output file", "cannot trim sector padding");
+    }
+    CloseHandle(op->file);
+    SDL_LockMutex(out->io_lock);
+    output_written(out, op->f->index, op->crc, op->size);
+    frame_release(op->f, op->recycle);
+    out->in_flight--;
+    SDL_CondBroadcast(out->drained);
+    SDL_UnlockMutex(out->io_lock);
+  }
+  return 0;
+}
+
+void start_async_writes(output_t *out, size_t direct_min) {
+  out->port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+  if (out->port == NULL)
+    __bad("create completion port", "");
+  out->ops = calloc(out->window, sizeof(write_op_t));
+  out->io_lock = SDL_CreateMutex();
+  out->drained = SDL_CreateCond();
+  out->direct_min = direct_min;
+  out->reaper = SDL_CreateThread(reaper_thread, "reaper", out);
+}
+
+// blocks until every queued write has landed, the reaper never takes
+// out->lock so commit may wait here while holding it
+void output_drain(output_t *out) {
+  if (out->port == NULL) return;
+  SDL_LockMutex(out->io_lock);
+  while (out->in_flight > 0) SDL_CondWait(out->drained, out->io_lock);
+  SDL_UnlockMutex(out->io_lock);
+}
+
+// called with out->lock held
+void output_queue(output_t *out, frame_t *f, const char *file, queue_t *recycle) {
+  write_op_t *op = &out->ops[f->slot];
+  bool direct = out->direct_min && f->data_size >= out->direct_min;
+  op->file = CreateFileA(file, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+    FILE_FLAG_OVERLAPPED | (direct ? FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH : 0), NULL);
+  if (op->file == INVALID_HANDLE_VALUE || CreateIoCompletionPort(op->file, out->port, 0, 0) == NULL)
+    __bad("write output file", file);
+  // frame data is sector aligned and its capacity a multiple of sectors
+  DWORD size = direct ? (f->data_size + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE : f->data_size;
+  memset(&op->ov, 0, sizeof(op->ov));
+  op->f = f;
+  op->recycle = recycle;
+  op->crc = f->crc;
+  op->size = f->data_size;
+  op->direct = direct;
+  SDL_AtomicIncRef(&f->refs);
+  SDL_LockMutex(out->io_lock);
+  out->in_flight++;
+  SDL_UnlockMutex(out->io_lock);
+  if (!WriteFile(op->file, f->data, size, NULL, &op->ov) && GetLastError() != ERROR_IO_PENDING)
+    __bad("write output file", file);
+}
+
+void output_frame(output_t *out, frame_t *f, queue_t *recycle) {
+  if (out->format == OUTPUT_Y4M) {
+    output_write(out, "FRAME\n", 6);
+    output_write(out, f->data, f->data_size);
+    
+  } else if (out->format == OUTPUT_PAM) {
+    char header[128];
+    int size = sprintf(header, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL %d\nTUPLTYPE RGB_ALPHA\nENDHDR\n",
+      out->ihdr.width, out->ihdr.height, out->ihdr.bit_depth == 16 ? 65535 : 255);
+    output_write(out, header, size);
+    if (f->data_size) {
+      output_write(out, f->data, f->data_size);
+    } else {
+      // 8 bit samples need no conversion, rows go out straight from readback
+      for (int row = out->ihdr.height - 1; row >= 0; row--) {
+        output_write(out, f->pixels + out->stride * row, out->stride);
+      }
+    }
+    
+  } else if (out->format == OUTPUT_APNG) {
+    // first frame is the default image and must cover the whole canvas
+    uint8_t fctl[26] = {0}; // dispose NONE, blend SOURCE
+    put_be32(fctl, out->sequence++);
+    put_be32(fctl + 4, f->rect[2]);
+    put_be32(fctl + 8, f->rect[3]);
+    put_be32(fctl + 12, f->rect[0]);
+    put_be32(fctl + 16, f->rect[1]);
+    put_be16(fctl + 20, 1);
+    put_be16(fctl + 22, out->fps);
+    output_chunk(out, "fcTL", fctl, 26, false);
+    for (size_t n = 0; n < f->data_size; n += APNG_CHUNK) {
+      size_t size = f->data_size - n < APNG_CHUNK ? f->data_size - n : APNG_CHUNK;
+      if (out->written == 0) output_chunk(out, "IDAT", f->data + n, size, false);
+      else output_chunk(out, "fdAT", f->data + n, size, true);
+    }
+    
+  } else if (out->zip) {
+    char entry[300];
+    sprintf(entry, "%s_%d.%s", out->name, f->index, out->format == OUTPUT_EXR ? "exr" : "png");
+    if (!mz_zip_writer_add_mem(out->zip, entry, f->data, f->data_size, MZ_NO_COMPRESSION))
+      __bad("write output archive", mz_zip_get_error_string(mz_zip_get_last_error(out->zip)));
+    
+  } else {
+    char out_join[300] = {0};
+    frame_path(out, f->index, out_join);
+    remove(out_join); // may be a hardlink into cache, never write through it
+    uint32_t crc = f->crc;
+    uint64_t size = f->data_size;
+    if (f->same >= 0) {
+      char same[300];
+      frame_path(out, f->same, same);
+      output_drain(out); // owner may still be queued
+      if (!link_file(same, out_join) || !crc_file(out_join, &crc, &size))
+        __bad("write output file", out_join);
+    } else if (out->port) {
+      output_queue(out, f, out_join, recycle);
+      return; // reaper adds it to manifest and cache
+    } else {
+      FILE *out_file = fopen(out_join, "wb");
+      if (out_file == NULL || fwrite(f->data, 1, f->data_size, out_file) != f->data_size)
+        __bad("write output file", out_join);
+      fclose(out_file);
+    }
+    output_written(out, f->index, crc, size);
+  }
+}
+
+// accepts frames in any order, written frames are handed back to recycle
+void output_commit(output_t *out, frame_t *f, queue_t *recycle) {
+  SDL_LockMutex(out->lock);
+  out->pending[f->index % out->window] = f;
+  while ((f = out->pending[out->next % out->window]) && f->index == out->next) {
+    uint64_t start = SDL_GetPerformanceCounter();
+    output_frame(out, f, recycle);
+    timing_add(out->timing, STAGE_WRITE, f->index, elapsed_ms(start));
+    if (out->timing) out->timing->bytes += f->data_size ? f->data_size : out->stride * out->ihdr.height;
+    out->pending[out->next % out->window] = NULL;
+    frame_release(f, recycle);
+    if (out->progress) {
+      fprintf(out->progress, "frame %d\n", out->next);
+      fflush(out->progress);
+    }
+    out->next++;
+    out->written++;
+    output_skip(out);
+  }
+  SDL_UnlockMutex(out->lock);
+}
+
+
+typedef struct pipeline_s {
+  queue_t free;    // recycled frames, bounds memory in flight
+  queue_t encode;
+  queue_t write;   // only used with write-behind thread
+  frame_t *frames;
+  int num_frames;
+  SDL_Thread **encoders;
+  int num_encoders;
+  SDL_Thread *writer;
+  tasks_t tasks;   // helpers for formats with independent chunks
+  output_t *out;
+  frame_t *last;   // most recently acquired frame
+} pipeline_t;
+
+
+bool frame_reserve(frame_t *f, size_t size) {
+  if (size > f->data_cap) {
+    size_t cap = f->data_cap ? f->data_cap : 1 << 16;
+    while (cap < size) cap *= 2;
+    void *data = _aligned_realloc(f->data, cap, SECTOR_SIZE); // unbuffered writes need it
+    if (data == NULL) return false;
+    f->data = data;
+    f->data_cap = cap;
+  }
+  return true;
+}
+
+int write_png_stream(spng_ctx *ctx, void *user, void *src, size_t length) {
+  frame_t *f = user;
+  if (!frame_reserve(f, f->data_size + length)) return SPNG_IO_ERROR;
+  memcpy(f->data + f->data_size, src, length);
+  f->data_size += length;
+  return 0;
+}
+
+// draft skips match search and keeps one cheap filter, archive tries all
+// filters with the slowest deflate level (miniz goes up to 10), balanced
+// is the spng default
+void set_png_speed(spng_ctx *enc, int speed) {
+  if (speed == PNG_DRAFT) {
+    spng_set_option(enc, SPNG_IMG_COMPRESSION_LEVEL, 1);
+    spng_set_option(enc, SPNG_IMG_COMPRESSION_STRATEGY, MZ_HUFFMAN_ONLY);
+    spng_set_option(enc, SPNG_FILTER_CHOICE, SPNG_FILTER_CHOICE_UP);
+  } else if (speed == PNG_ARCHIVE) {
+    spng_set_option(enc, SPNG_IMG_COMPRESSION_LEVEL, MZ_UBER_COMPRESSION);
+    spng_set_option(enc, SPNG_IMG_COMPRESSION_STRATEGY, MZ_FILTERED);
+    spng_set_option(enc, SPNG_FILTER_CHOICE, SPNG_FILTER_CHOICE_ALL);
+  }
+}
+
+// large images are filtered and deflated in row groups on the task pool,
+// pigz style: every group but the last ends on a sync flush so the raw
+// deflate streams concatenate into one zlib stream, the Adler-32 of the
+// whole is combined from the groups
+
+#define PNG_GROUP_SIZE (1 << 20)     // raw bytes per row group
+#define PNG_PARALLEL_MIN (8 << 20)   // smaller images go through spng
+
+typedef struct png_job_s {
+  output_t *out;
+  frame_t *f;
+  int rows;        // per group
+  size_t bound;    // compressed slot size of one group
+  uint8_t *slots;
+  size_t *sizes;
+  uint32_t *adlers;
+  int num_groups;
+} png_job_t;
+
+uint8_t paeth(uint8_t a, uint8_t b, uint8_t c) {
+  int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// one filtered scanline, returns the sum of absolute values of its bytes
+size_t filter_row(uint8_t *dst, const uint8_t *cur, const uint8_t *prev, size_t size, size_t bpp, int type) {
+  dst[0] = type;
+  uint8_t *d = dst + 1;
+  switch (type) {
+    case 0: memcpy(d, cur, size); break;
+    case 1:
+      for (size_t n = 0; n < size; n++) d[n] = cur[n] - (n >= bpp ? cur[n - bpp] : 0);
+      break;
+    case 2:
+      for (size_t n = 0; n < size; n++) d[n] = cur[n] - prev[n];
+      break;
+    case 3:
+      for (size_t n = 0; n < size; n++) d[n] = cur[n] - (((n >= bpp ? cur[n - bpp] : 0) + prev[n]) >> 1);
+      break;
+    case 4:
+      for (size_t n = 0; n < size; n++) {
+        d[n] = cur[n] - (n >= bpp ? paeth(cur[n - bpp], prev[n], prev[n - bpp]) : prev[n]);
+      }
+      break;
+  }
+  size_t sum = 0;
+  for (size_t n = 0; n < size; n++) sum += abs((int8_t)d[n]);
+  return sum;
+}
+
+// GL row of the frame in PNG byte order
+void png_row(output_t *out, frame_t *f, int y, uint8_t *dst) {
+  size_t bpp = out->stride / out->ihdr.width, size = bpp * f->rect[2];
+  uint8_t *src = f->pixels + out->stride * (out->ihdr.height - 1 - f->rect[1] - y) + bpp * f->rect[0];
+  if (out->ihdr.bit_depth == 16) {
+    for (size_t n = 0; n < size; n += 2) {
+      dst[n] = src[n + 1];
+      dst[n + 1] = src[n];
+    }
+  } else {
+    memcpy(dst, src, size);
+  }
+}
+
+void png_group(void *user, int group) {
+  png_job_t *job = user;
+  output_t *out = job->out;
+  size_t bpp = out->stride / out->ihdr.width, size = bpp * job->f->rect[2];
+  int first = group * job->rows;
+  int rows = job->f->rect[3] - first < job->rows ? job->f->rect[3] - first : job->rows;
+  bool last = group == job->num_groups - 1;
+  
+  // previous and current row, plus one filtered candidate per type
+  size_t raw_size = (size + 1) * rows;
+  uint8_t *raw = arena_alloc(raw_size + size * 2 + (size + 1) * 5);
+  tdefl_compressor *comp = arena_alloc(sizeof(tdefl_compressor));
+  if (raw == NULL || comp == NULL)
+    __bad("encode frame", "out of memory");
+  uint8_t *prev = raw + raw_size, *cur = prev + size, *trial = cur + size;
+  
+  // first row of a group still filters against the row above it
+  if (first > 0) png_row(out, job->f, first - 1, prev);
+  else memset(prev, 0, size);
+  for (int y = 0; y < rows; y++) {
+    uint8_t *dst = raw + (size + 1) * y;
+    png_row(out, job->f, first + y, cur);
+    if (out->png_speed == PNG_DRAFT) {
+      filter_row(dst, cur, prev, size, bpp, 2);
+    } else {
+      // minimum sum of absolute differences, the heuristic spng uses
+      size_t best = SIZE_MAX;
+      for (int type = 0; type < 5; type++) {
+        size_t sum = filter_row(trial, cur, prev, size, bpp, type);
+        if (sum < best) {
+          best = sum;
+          memcpy(dst, trial, size + 1);
+        }
+      }
+    }
+    uint8_t *swap = prev; prev = cur; cur = swap;
+  }
+  
+  int level = out->png_speed == PNG_DRAFT ? 1 : out->png_speed == PNG_ARCHIVE ? MZ_UBER_COMPRESSION : MZ_DEFAULT_LEVEL;
+  int strategy = out->png_speed == PNG_DRAFT ? MZ_HUFFMAN_ONLY : MZ_FILTERED;
+  tdefl_init(comp, NULL, NULL, tdefl_create_comp_flags_from_zip_params(level, -MZ_DEFAULT_WINDOW_BITS, strategy));
+  size_t in_size = raw_size, out_size = job->bound;
+  tdefl_status status = tdefl_compress(comp, raw, &in_size, job->slots + job->bound * group, &out_size,
+    last ? TDEFL_FINISH : TDEFL_SYNC_FLUSH);
+  if (in_size != raw_size || status != (last ? TDEFL_STATUS_DONE : TDEFL_STATUS_OKAY))
+    __bad("encode frame", "deflate failed");
+  job->sizes[group] = out_size;
+  job->adlers[group] = mz_adler32(MZ_ADLER32_INIT, raw, raw_size);
+  arena_free(comp);
+  arena_free(raw);
+}
+
+// Adler-32 of two concatenated blocks from their own sums, as in zlib
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2) {
+  const uint32_t base = 65521;
+  uint32_t rem = len2 % base;
+  uint32_t sum1 = adler1 & 0xffff;
+  uint32_t sum2 = (rem * sum1) % base;
+  sum1 += (adler2 & 0xffff) + base - 1;
+  sum2 += (adler1 >> 16) + (adler2 >> 16) + base - rem;
+  if (sum1 >= base) sum1 -= base;
+  if (sum1 >= base) sum1 -= base;
+  if (sum2 >= (base << 1)) sum2 -= (base << 1);
+  if (sum2 >= base) sum2 -= base;
+  return sum1 | (sum2 << 16);
+}
+
+uint8_t* put_png_chunk(uint8_t *p, const char *type, const void *data, size_t size) {
+  put_be32(p, size);
+  memcpy(p + 4, type, 4);
+  memcpy(p + 8, data, size);
+  put_be32(p + 8 + size, mz_crc32(mz_crc32(MZ_CRC32_INIT, p + 4, 4), data, size));
+  return p + 12 + size;
+}
+
+void encode_png_parallel(output_t *out, tasks_t *tasks, frame_t *f) {
+  size_t bpp = out->stride / out->ihdr.width, size = bpp * f->rect[2];
+  png_job_t job = { out, f };
+  job.rows = PNG_GROUP_SIZE / (size + 1) ? PNG_GROUP_SIZE / (size + 1) : 1;
+  job.num_groups = (f->rect[3] + job.rows - 1) / job.rows;
+  job.bound = mz_compressBound((size + 1) * job.rows) + 16; // + sync flush marker
+  job.slots = arena_alloc(job.bound * job.num_groups);
+  job.sizes = arena_alloc(sizeof(size_t) * job.num_groups);
+  job.adlers = arena_alloc(sizeof(uint32_t) * job.num_groups);
+  if (job.slots == NULL || job.sizes == NULL || job.adlers == NULL)
+    __bad("encode frame", "out of memory");
+  
+  tasks_run(tasks, png_group, &job, job.num_groups);
+  
+  // zlib stream: header, groups back to back, combined checksum
+  int level = out->png_speed == PNG_DRAFT ? 0 : out->png_speed == PNG_ARCHIVE ? 3 : 2;
+  size_t stream_size = 2 + 4;
+  for (int n = 0; n < job.num_groups; n++) stream_size += job.sizes[n];
+  uint8_t *stream = arena_alloc(stream_size), *s = stream;
+  if (stream == NULL)
+    __bad("encode frame", "out of memory");
+  *s++ = 0x78;
+  *s++ = (uint8_t[]){ 0x01, 0x5e, 0x9c, 0xda }[level];
+  uint32_t adler = MZ_ADLER32_INIT;
+  for (int n = 0; n < job.num_groups; n++) {
+    memcpy(s, job.slots + job.bound * n, job.sizes[n]);
+    s += job.sizes[n];
+    int rows = f->rect[3] - n * job.rows < job.rows ? f->rect[3] - n * job.rows : job.rows;
+    adler = adler32_combine(adler, job.adlers[n], (size + 1) * rows);
+  }
+  put_be32(s, adler);
+  arena_free(job.slots);
+  arena_free(job.sizes);
+  arena_free(job.adlers);
+  
+  size_t idats = (stream_size + APNG_CHUNK - 1) / APNG_CHUNK;
+  if (!frame_reserve(f, 8 + 25 + 12 * idats + stream_size + 12))
+    __bad("encode frame", "out of memory");
+  uint8_t ihdr[13] = {0};
+  put_be32(ihdr, f->rect[2]);
+  put_be32(ihdr + 4, f->rect[3]);
+  ihdr[8] = out->ihdr.bit_depth;
+  ihdr[9] = out->ihdr.color_type;
+  uint8_t *p = f->data;
+  memcpy(p, "\x89PNG\r\n\x1a\n", 8);
+  p = put_png_chunk(p + 8, "IHDR", ihdr, 13);
+  for (size_t n = 0; n < stream_size; n += APNG_CHUNK) {
+    p = put_png_chunk(p, "IDAT", stream + n, stream_size - n < APNG_CHUNK ? stream_size - n : APNG_CHUNK);
+  }
+  p = put_png_chunk(p, "IEND", NULL, 0);
+  f->data_size = p - (uint8_t*)f->data;
+  arena_free(stream);
+}
+
+// encodes f->rect region of the frame as a complete PNG
+void encode_png(output_t *out, tasks_t *tasks, frame_t *f) {
+  if (out->stride / out->ihdr.width * f->rect[2] * f->rect[3] >= PNG_PARALLEL_MIN && tasks->num_threads > 0) {
+    encode_png_parallel(out, tasks, f);
+    return;
+  }
+  struct spng_ihdr ihdr = out->ihdr;
+  ihdr.width = f->rect[2];
+  ihdr.height = f->rect[3];
+  size_t bpp = out->stride / out->ihdr.width;
+  void *origin = f->pixels + bpp * f->rect[0];
+  
+  spng_ctx *enc = create_encoder();
+  spng_set_png_stream(enc, write_png_stream, f);
+  spng_set_ihdr(enc, &ihdr);
+  set_png_speed(enc, out->png_speed);
+  int error = spng_encode_image(enc, NULL, 0, SPNG_FMT_PNG, SPNG_ENCODE_PROGRESSIVE | SPNG_ENCODE_FINALIZE);
+  // PNG is top-down, feed GL rows in reverse instead of flipping
+  int top = out->ihdr.height - 1 - f->rect[1];
+  for (int row = top; row > top - f->rect[3] && !error; row--) {
+    error = spng_encode_row(enc, origin + out->stride * row, bpp * ihdr.width);
+  }
+  if (error != SPNG_EOI)
+    __bad("encode frame", spng_strerror(error));
+  spng_ctx_free(enc);
+}
+
+// only the region changed since previous frame is encoded, its IDAT
+// payload becomes the fdAT stream of the animation frame
+void encode_apng(output_t *out, tasks_t *tasks, frame_t *f) {
+  int w = out->ihdr.width, h = out->ihdr.height;
+  if (f->prev && !diff_rect(f->prev->pixels, f->pixels, w, h, out->stride, f->rect)) {
+    memcpy(f->rect, (int[]){ 0, 0, 1, 1 }, sizeof(f->rect)); // unchanged, APNG forbids empty frames
+  }
+  encode_png(out, tasks, f);
+  
+  uint8_t *chunk = f->data + 8, *end = f->data + f->data_size, *stream = f->data;
+  while (chunk + 12 <= end) {
+    uint32_t size = get_be32(chunk);
+    if (memcmp(chunk + 4, "IDAT", 4) == 0) {
+      memmove(stream, chunk + 8, size);
+      stream += size;
+    }
+    chunk += size + 12;
+  }
+  f->data_size = stream - (uint8_t*)f->data;
+}
+
+// planar 4:4:4 with BT.601 studio range, what y4m readers assume by default
+void encode_y4m(output_t *out, frame_t *f) {
+  int w = out->ihdr.width, h = out->ihdr.height;
+  bool wide = out->ihdr.bit_depth == 16;
+  size_t plane = (size_t)w * h;
+  if (!frame_reserve(f, plane * 3 * (wide ? 2 : 1)))
+    __bad("encode frame", "out of memory");
+  f->data_size = plane * 3 * (wide ? 2 : 1);
+  
+  float one = wide ? 65535 : 255;
+  float range = wide ? 256 : 1;
+  for (int y = 0; y < h; y++) {
+    void *row = f->pixels + out->stride * (h - 1 - y);
+    for (int x = 0; x < w; x++) {
+      float c[3];
+      for (int n = 0; n < 3; n++) {
+        c[n] = (wide ? ((uint16_t*)row)[x * 4 + n] : ((uint8_t*)row)[x * 4 + n]) / one;
+      }
+      float yuv[3] = {
+        range * (16 + 65.481 * c[0] + 128.553 * c[1] + 24.966 * c[2]) + 0.5,
+        range * (128 - 37.797 * c[0] - 74.203 * c[1] + 112.0 * c[2]) + 0.5,
+        range * (128 + 112.0 * c[0] - 93.786 * c[1] - 18.214 * c[2]) + 0.5 };
+      size_t i = (size_t)y * w + x;
+      for (int n = 0; n < 3; n++) {
+        if (wide) ((uint16_t*)f->data)[plane * n + i] = yuv[n];
+        else ((uint8_t*)f->data)[plane * n + i] = yuv[n];
+      }
+    }
+  }
+}
+
+// PAM wants big-endian samples, 8 bit frames are written without encoding
+void encode_pam(output_t *out, frame_t *f) {
+  if (out->ihdr.bit_depth != 16) return;
+  int h = out->ihdr.height;
+  if (!frame_reserve(f, out->stride * h))
+    __bad("encode frame", "out of memory");
+  f->data_size = out->stride * h;
+  for (int y = 0; y < h; y++) {
+    uint16_t *src = f->pixels + out->stride * (h - 1 - y);
+    uint16_t *dst = f->data + out->stride * y;
+    for (size_t n = 0; n < out->stride / 2; n++) {
+      dst[n] = (src[n] >> 8) | (src[n] << 8);
+    }
+  }
+}
+
+uint8_t* exr_attribute(uint8_t *p, const char *name, const char *type, const void *value, int32_t size) {
+  size_t name_size = strlen(name) + 1, type_size = strlen(type) + 1;
+  memcpy(p, name, name_size);
+  memcpy(p + name_size, type, type_size);
+  p += name_size + type_size;
+  memcpy(p, &size, 4);
+  memcpy(p + 4, value, size);
+  return p + 4 + size;
+}
+
+// minimal scanline header, channels must be listed in name order
+size_t exr_header(output_t *out, uint8_t *header) {
+  int32_t type = out->ihdr.bit_depth == 32 ? 2 : 1; // FLOAT or HALF
+  uint8_t channels[4 * 18 + 1] = {0};
+  for (int c = 0; c < 4; c++) {
+    uint8_t *ch = channels + c * 18;
+    ch[0] = "ABGR"[c];
+    memcpy(ch + 2, &type, 4);
+    memcpy(ch + 10, (int32_t[]){ 1, 1 }, 8); // x,y sampling
+  }
+  int32_t window[4] = { 0, 0, out->ihdr.width - 1, out->ihdr.height - 1 };
+  float one = 1, center[2] = { 0, 0 };
+  uint8_t zip = 3, increasing_y = 0;
+  
+  uint8_t *p = header;
+  memcpy(p, (uint8_t[]){ 0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0 }, 8);
+  p = exr_attribute(p + 8, "channels", "chlist", channels, sizeof(channels));
+  p = exr_attribute(p, "compression", "compression", &zip, 1);
+  p = exr_attribute(p, "dataWindow", "box2i", window, 16);
+  p = exr_attribute(p, "displayWindow", "box2i", window, 16);
+  p = exr_attribute(p, "lineOrder", "lineOrder", &increasing_y, 1);
+  p = exr_attribute(p, "pixelAspectRatio", "float", &one, 4);
+  p = exr_attribute(p, "screenWindowCenter", "v2f", center, 8);
+  p = exr_attribute(p, "screenWindowWidth", "float", &one, 4);
+  *p++ = 0;
+  return p - header;
+}
+
+
+typedef struct exr_job_s {
+  output_t *out;
+  frame_t *f;
+  size_t raw;    // bytes of a full chunk before compression
+  size_t bound;  // compressed size limit of one chunk
+  size_t base;   // offset of first chunk slot in frame data
+} exr_job_t;
+
+// one chunk goes to its own slot of frame data, slots are packed afterwards
+void exr_chunk(void *user, int chunk) {
+  exr_job_t *job = user;
+  output_t *out = job->out;
+  int w = out->ihdr.width, h = out->ihdr.height;
+  int first = chunk * EXR_LINES;
+  int lines = h - first < EXR_LINES ? h - first : EXR_LINES;
+  size_t bytes = out->ihdr.bit_depth / 8;
+  size_t raw = (size_t)lines * w * 4 * bytes;
+  uint8_t *slot = job->f->data + job->base + (8 + job->bound) * chunk;
+  uint8_t *planar = arena_alloc(raw * 2), *shuffled = planar + raw;
+  if (planar == NULL)
+    __bad("encode frame", "out of memory");
+  
+  // each line holds its channels one after another
+  uint8_t *p = planar;
+  for (int y = first; y < first + lines; y++) {
+    void *row = job->f->pixels + out->stride * (h - 1 - y);
+    for (int c = 3; c >= 0; c--, p += w * bytes) {
+      for (int x = 0; x < w; x++) {
+        if (bytes == 2) ((uint16_t*)p)[x] = ((uint16_t*)row)[x * 4 + c];
+        else ((uint32_t*)p)[x] = ((uint32_t*)row)[x * 4 + c];
+      }
+    }
+  }
+  // ZIP predictor: even bytes then odd bytes, delta coded
+  size_t half = (raw + 1) / 2;
+  for (size_t n = 0; n < raw; n++) {
+    shuffled[n / 2 + (n & 1) * half] = planar[n];
+  }
+  for (size_t n = raw - 1; n > 0; n--) {
+    shuffled[n] = shuffled[n] - shuffled[n - 1] + 128;
+  }
+  // same stream as mz_compress2, without its heap allocated compressor
+  tdefl_compressor *comp = arena_alloc(sizeof(tdefl_compressor));
+  if (comp == NULL)
+    __bad("encode frame", "out of memory");
+  tdefl_init(comp, NULL, NULL, tdefl_create_comp_flags_from_zip_params(MZ_DEFAULT_COMPRESSION, MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY));
+  size_t in_size = raw, size = job->bound;
+  tdefl_status status = tdefl_compress(comp, shuffled, &in_size, slot + 8, &size, TDEFL_FINISH);
+  arena_free(comp);
+  if (status != TDEFL_STATUS_DONE || size >= raw) {
+    memcpy(slot + 8, planar, raw); // stored, readers detect it by size
+    size = raw;
+  }
+  memcpy(slot, (int32_t[]){ first, size }, 8);
+  arena_free(planar);
+}
+
+// scanline EXR, chunks of one frame are compressed in parallel
+void encode_exr(output_t *out, tasks_t *tasks, frame_t *f) {
+  int chunks = (out->ihdr.height + EXR_LINES - 1) / EXR_LINES;
+  uint8_t header[512];
+  size_t header_size = exr_header(out, header);
+  exr_job_t job = { out, f, out->stride * EXR_LINES };
+  job.bound = mz_compressBound(job.raw);
+  job.base = header_size + chunks * 8;
+  if (!frame_reserve(f, job.base + (8 + job.bound) * chunks))
+    __bad("encode frame", "out of memory");
+  memcpy(f->data, header, header_size);
+  
+  tasks_run(tasks, exr_chunk, &job, chunks);
+  
+  size_t end = job.base;
+  for (int n = 0; n < chunks; n++) {
+    uint8_t *slot = f->data + job.base + (8 + job.bound) * n;
+    uint32_t size;
+    memcpy(&size, slot + 4, 4);
+    memcpy(f->data + header_size + n * 8, &(uint64_t){ end }, 8);
+    memmove(f->data + end, slot, 8 + size);
+    end += 8 + size;
+  }
+  f->data_size = end;
+}
+
+int encoder_thread(void *user) {
+  pipeline_t *pl = user;
+  frame_t *f;
+  while ((f = queue_pop(&pl->encode))) {
+    f->data_size = 0;
+    memcpy(f->rect, (int[]){ 0, 0, pl->out->ihdr.width, pl->out->ihdr.height }, sizeof(f->rect));
+    uint64_t start = SDL_GetPerformanceCounter();
+    f->same = output_same(pl->out, f);
+    if (f->same < 0) switch (pl->out->format) {
+      case OUTPUT_PNG : encode_png(pl->out, &pl->tasks, f); break;
+      case OUTPUT_Y4M : encode_y4m(pl->out, f); break;
+      case OUTPUT_PAM : encode_pam(pl->out, f); break;
+      case OUTPUT_APNG : encode_apng(pl->out, &pl->tasks, f); break;
+      case OUTPUT_EXR : encode_exr(pl->out, &pl->tasks, f); break;
+    }
+    if (f->prev) frame_release(f->prev, &pl->free);
+    if (pl->out->manifest && f->same < 0) f->crc = mz_crc32(MZ_CRC32_INIT, f->data, f->data_size);
+    timing_add(pl->out->timing, STAGE_ENCODE, f->index, elapsed_ms(start));
+    if (pl->writer) {
+      queue_push(&pl->write, f);
+    } else {
+      output_commit(pl->out, f, &pl->free);
+    }
+  }
+  dispose_arena();
+  return 0;
+}
+
+// keeps encoders busy while file system is slow
+int writer_thread(void *user) {
+  pipeline_t *pl = user;
+  frame_t *f;
+  while ((f = queue_pop(&pl->write))) {
+    output_commit(pl->out, f, &pl->free);
+  }
+  return 0;
+}
+
+
+// one frame per readback slot, pixels are never copied out of the slot
+void start_pipeline(pipeline_t *pl, output_t *out, readback_t *rb, int num_encoders, bool write_behind) {
+  pl->out = out;
+  pl->num_encoders = num_encoders;
+  pl->num_frames = rb->num_slots;
+  pl->free = create_queue(pl->num_frames);
+  pl->encode = create_queue(pl->num_frames);
+  pl->write = create_queue(pl->num_frames);
+  pl->frames = calloc(pl->num_frames, sizeof(frame_t));
+  pl->tasks = create_tasks(out->format == OUTPUT_Y4M || out->format == OUTPUT_PAM ? 0 : num_encoders);
+  start_tasks(&pl->tasks);
+  for (int n = 0; n < pl->num_frames; n++) {
+    pl->frames[n].slot = n;
+    pl->frames[n].pixels = rb->data[n];
+    pl->frames[n].pixels_size = rb->size;
+    queue_push(&pl->free, &pl->frames[n]);
+  }
+  if (write_behind) {
+    pl->writer = SDL_CreateThread(writer_thread, "writer", pl);
+  }
+  pl->encoders = calloc(num_encoders, sizeof(SDL_Thread*));
+  for (int n = 0; n < num_encoders; n++) {
+    pl->encoders[n] = SDL_CreateThread(encoder_thread, "encoder", pl);
+  }
+}
+
+// next free frame, delta formats and per-frame files keep the previous one
+// alive for diffing and duplicate checks
+frame_t* pipeline_acquire(pipeline_t *pl, int index) {
+  output_t *out = pl->out;
+  bool delta = out->format == OUTPUT_APNG || ((out->format == OUTPUT_PNG || out->format == OUTPUT_EXR) && !out->zip);
+  frame_t *f = queue_pop(&pl->free);
+  f->index = index;
+  f->prev = delta ? pl->last : NULL;
+  SDL_AtomicSet(&(f->refs), delta ? 2 : 1);
+  pl->last = f;
+  return f;
+}
+
+// drain all stages and release frames
+void finish_pipeline(pipeline_t *pl) {
+  queue_close(&pl->encode);
+  for (int n = 0; n < pl->num_encoders; n++) {
+    SDL_WaitThread(pl->encoders[n], NULL);
+  }
+  queue_close(&pl->write);
+  if (pl->writer) SDL_WaitThread(pl->writer, NULL);
+  output_drain(pl->out);
+  dispose_tasks(&pl->tasks);
+  for (int n = 0; n < pl->num_frames; n++) {
+    _aligned_free(pl->frames[n].data);
+  }
+  free(pl->frames);
+  free(pl->encoders);
+  dispose_queue(pl->free);
+  dispose_queue(pl->encode);
+  dispose_queue(pl->write);
+}
+
+
+// BAND EXPORT
+// images larger than a texture are drawn in horizontal bands, band rows go
+// straight from readback into the progressive encoder, memory is bounded
+// by the band size
+
+typedef struct file_stream_s {
+  FILE *file;
+  uint32_t crc;
+  uint64_t size;
+} file_stream_t;
+
+
+int write_file_stream(spng_ctx *ctx, void *user, void *src, size_t length) {
+  file_stream_t *stream = user;
+  if (fwrite(src, 1, length, stream->file) != length) return SPNG_IO_ERROR;
+  stream->crc = mz_crc32(stream->crc, src, length);
+  stream->size += length;
+  return 0;
+}
+
+// band N+1 renders while rows of band N are encoded
+void render_bands(output_t *out, offscreen_t off, readback_t *rb, exposure_t ex, int num_bands, int index, float time, GLenum type) {
+  int band = off.wh[1], height = out->ihdr.height;
+  char file[300];
+  frame_path(out, index, file);
+  remove(file); // may be a hardlink into cache
+  file_stream_t stream = { fopen(file, "wb"), MZ_CRC32_INIT, 0 };
+  if (stream.file == NULL)
+    __bad("write output file", file);
+  
+  spng_ctx *enc = create_encoder();
+  spng_set_png_stream(enc, write_file_stream, &stream);
+  spng_set_ihdr(enc, &out->ihdr);
+  set_png_speed(enc, out->png_speed);
+  int error = spng_encode_image(enc, NULL, 0, SPNG_FMT_PNG, SPNG_ENCODE_PROGRESSIVE | SPNG_ENCODE_FINALIZE);
+  begin_exposure(ex, time);
+  for (int n = 0, done = 0; done < num_bands && !error; ) {
+    int slot = n % rb->num_slots;
+    if (n < num_bands && n - done < rb->num_slots) {
+      glBeginQuery(GL_TIME_ELAPSED, out->timing->queries[slot]);
+      render_export(off, ex, n, time);
+      glEndQuery(GL_TIME_ELAPSED);
+      readback_push(rb, slot, out->ihdr.width, band, GL_RGBA, type);
+      n++;
+      continue;
+    }
+    slot = done % rb->num_slots;
+    uint64_t start = SDL_GetPerformanceCounter();
+    void *pixels = readback_wait(rb, slot);
+    timing_add(out->timing, STAGE_READBACK, index, elapsed_ms(start));
+    timing_gpu(out->timing, slot, index);
+    
+    // file writes happen inside the encoder and count as encode time
+    start = SDL_GetPerformanceCounter();
+    int rows = height - done * band < band ? height - done * band : band;
+    for (int row = band - 1; row >= band - rows && !error; row--) {
+      error = spng_encode_row(enc, pixels + out->stride * row, out->stride);
+    }
+    timing_add(out->timing, STAGE_ENCODE, index, elapsed_ms(start));
+    done++;
+  }
+  end_exposure(ex, time);
+  if (error != SPNG_EOI)
+    __bad("encode frame", spng_strerror(error));
+  spng_ctx_free(enc);
+  if (fclose(stream.file) != 0)
+    __bad("write output file", file);
+  output_written(out, index, stream.crc, stream.size);
+  out->timing->bytes += stream.size;
+  if (out->progress) {
+    fprintf(out->progress, "frame %d\n", index);
+    fflush(out->progress);
+  }
+}
+
+
+static const char* usage = 
+"shader-view: interactive preview for 2D fragment shaders.\n\n"
+"modes: \n\n"
+"shader-view -f shader.frag -- non interactive with hot-reload.\n"
+"shader-view -i -f shader.frag -- interactive with mouse and time input.\n"
+"shader-view -a N -f shader.frag -o name -- save one cycle of animation.\n\n"
+"other options: \n\n"
+"-x W,H   -- set window width and height (default 600,600).\n"
+"-d value -- delay in milliseconds between window updates (default 20).\n"
+"-a N     -- number of frames to save (remember time goes from 0.0 to 1.0).\n"
+"-o name  -- images saved as name_1.png name_2.png name_N.png, listed in name.manifest,\n"
+"            a rerun renders only missing or corrupt images, -o name.zip stores them in one archive.\n"
+"--format png|y4m|pam|apng|exr -- y4m and pam stream raw frames to -o file, pipe or - for stdout,\n"
+"                          apng writes one animated file storing only changed regions,\n"
+"                          exr writes unclamped half or float images.\n"
+"-t N     -- number of encoder threads (default cores - 1).\n"
+"--readback-mb MB -- memory budget of mapped readback frames in flight (default 1024).\n"
+"-w 0|1|2 -- write files on a separate write-behind thread (default 1), 2 queues png/exr files as overlapped I/O.\n"
+"--direct MB -- with -w 2 frames of MB or more bypass the system cache (default 0, never).\n"
+"--preview-every N -- show every Nth exported frame (default 0, hidden window).\n"
+"--depth 8|16|32 -- bits per channel of exported images (default 16, 32 is float exr only).\n"
+"--dither none|ordered|noise -- dithering of 8 bit export (default ordered).\n"
+"--frames A:B -- export only frames A to B-1, times and names stay as in the full run.\n"
+"--shard i/N -- export the i-th of N equal parts of the frame range.\n"
+"-j N     -- render shards in N headless worker processes (png and exr only).\n"
+"--progress -- report exported frames on stdout, used by -j workers.\n"
+"--cache dir -- keep encoded png/exr frames in dir, frames with same code, settings\n"
+"               and time are linked from there instead of rendered.\n"
+"--band N -- render png export in bands of N rows, for images larger than GPU textures.\n"
+"--ssaa N -- average N x N sub-pixel jittered passes of every exported frame (default 1).\n"
+"--blur K,S -- motion blur, average K subframes over S frame intervals around each frame (S default 0.5).\n"
+"--stats file -- also write the timing report printed after export as json.\n"
+"--png-speed draft|balanced|archive -- png compression effort (default balanced).\n"
+"--sweep L[x|y]=A:B:N[,...] -- instead of -a export one image per value of uniform location L\n"
+"                           (x or y of a vec2, 1 is mouse) from A to B in N steps, two axes make a grid.\n"
+"--sheet  -- with --sweep tile all images into one contact sheet name_0.png, a row per step of the second axis.\n"
+"--time T -- time of sweep images (default 0).\n"
+"--batch file -- export one job per line of file, each line holds options as above,\n"
+"                options next to --batch apply to every job that does not set them.\n"
+"--precision rgba8|rgba16f|rgba32f|rgb32f -- color format of the offscreen target (default rgb32f),\n"
+"                          rgba formats keep shader alpha in exported images.\n"
+"--depth-stencil -- attach a depth and stencil buffer to the offscreen target (default none).\n";
+
+const char *bypass_vert =
+"#version 430 \n"
+"layout(location = 0) in vec3 pos; \n"
+"layout(location = 1) in vec3 tex; \n"
+"sample smooth out vec2 uv; \n"
+"void main() { gl_Position = vec4(pos, 1.); uv = tex.xy; } \n";
+
+const char *post_frag =
+"#version 430 \n"
+"sample smooth in vec2 uv; \n"
+"out vec4 color; \n"
+"uniform sampler2D tex; \n"
+"layout(location = 0) uniform int mode;\n "
+
+"vec3 color_picker(vec2 uv) { \n"
+"  vec3 hsb = clamp(vec3(uv.x, uv.y, 1.), 0., 1.); \n"
+"  vec3 rgb = clamp(abs(mod(hsb.x*6.0+vec3(0.0,4.0,2.0),6.0)-3.0)-1.0, 0.0,1.0 ); \n"
+"  rgb = rgb*rgb*(3.0-2.0*rgb); \n"
+"  return hsb.z * mix(vec3(1.0), rgb, hsb.y); } \n"
+
+"void main() { \n"
+" vec2 ts = textureSize(tex, 0); \n"
+" vec2 pp = uv / max(vec2(1.0), (ts.xy / ts.yx)); \n"
+" vec4 cc = texture2D(tex, (pp + 1) * .5); \n"
+" switch(mode) { \n"
+"   case 0 : color = cc; break; \n"
+"   case 1 : color = vec4(vec3(cc.r), 1.); break; \n"
+"   case 2 : color = vec4(vec3(cc.g), 1.); break; \n"
+"   case 3 : color = vec4(vec3(cc.b), 1.); break; \n"
+"   case 4 : color = abs(cc); break; \n"
+"   case 5 : color = vec4(1 - cc.rgb, 1.); break; \n"
+"   case 6 : color = vec4(color_picker((pp + 1) * 0.5), 1.); } \n"
+"} \n";
+
+const char *quant_frag =
+"#version 430 \n"
+"out vec4 color; \n"
+"uniform sampler2D tex; \n"
+"layout(location = 0) uniform int dither;\n "
+
+"float bayer(ivec2 p) { \n"
+"  int x = p.x & 7, v = (p.x ^ p.y) & 7; \n"
+"  int m = ((v & 1) << 5) | ((x & 1) << 4) | ((v & 2) << 2) | ((x & 2) << 1) | ((v & 4) >> 1) | ((x & 4) >> 2); \n"
+"  return (m + 0.5) / 64.; } \n"
+
+"float noise(vec2 p) { \n"
+"  return fract(52.9829189 * fract(dot(p, vec2(0.06711056, 0.00583715)))); } \n"
+
+"void main() { \n"
+" ivec2 p = ivec2(gl_FragCoord.xy); \n"
+" vec4 cc = clamp(texelFetch(tex, p, 0), 0., 1.); \n"
+" float t = 0.5; \n"
+" switch(dither) { \n"
+"   case 1 : t = bayer(p); break; \n"
+"   case 2 : t = noise(gl_FragCoord.xy); } \n"
+" color = floor(cc * 255. + t) / 255.; \n"
+"} \n";
+
+
+
+
+
+int argument_pos(int argc, char **argv, const char *arg) {
+  for (int n = 0; n < argc; n++) {
+    if (strcmp(argv[n], arg) == 0) return n;
+  }
+  return 0;
+}
+
+// color format of the direct target, default RGB32F keeps alpha at 1 as before
+GLenum parse_precision(int argc, char **argv) {
+  int precision_arg = argument_pos(argc, argv, "--precision");
+  if (precision_arg == 0) return GL_RGB32F;
+  const char *names[] = { "rgba8", "rgba16f", "rgba32f", "rgb32f" };
+  const GLenum formats[] = { GL_RGBA8, GL_RGBA16F, GL_RGBA32F, GL_RGB32F };
+  for (int n = 0; n < 4; n++) {
+    if (strcmp(argv[precision_arg + 1], names[n]) == 0) return formats[n];
+  }
+  __bad("set precision", argv[precision_arg + 1]);
+  return 0;
+}
+
+
+void copy_to_clipboard(const char* msg) {
+  size_t ml = strlen(msg);
+  void* clip = GlobalAlloc(GMEM_MOVEABLE | GMEM_DDESHARE, ml + 1);
+  void* clip_mem = GlobalLock(clip);
+  memcpy(clip_mem, msg, ml);
+  ((char*)clip_mem)[ml] = 0;
+  GlobalUnlock(clip);
+  
+  if (OpenClipboard(NULL)) {
+    EmptyClipboard();
+    SetClipboardData(CF_TEXT, clip);
+    CloseClipboard();
+  }
+}
+
+
+
+
+void update_info(GLTtext *info, int x, int y, GLuint fb, char* clipboard) {
+  float px[3] = {0};
+  char  xx[16 * 3] = {0};
+  char  sn[3];
+  glBindFramebuffer(GL_FRAMEBUFFER, fb);
+  glReadPixels(x, y, 1, 1, GL_RGB, GL_FLOAT, px);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  for (int n = 0; n < 3; n++) { 
+    if (!isinf(px[n]) && !isnan(px[n])) {
+      sn[n] = px[n] >= 0 ? '+' : '-';
+      px[n] = fabs(px[n]);
+      sprintf(xx + 16 * n, "%1.3f", px[n]);
+    } else {
+      sn[n] = '?';
+      sprintf(xx + 16 * n, "%s", "?.???");
+    }
+  }
+  if (clipboard) {
+   memset(clipboard, 0, strlen(clipboard)); 
+   sprintf(clipboard, "vec4(%.5s, %.5s, %.5s, 1.0)", xx, xx+16, xx+32); 
+  }
+  sprintf(info->_text, "INFO/R%c%.5s/G%c%.5s/B%c%.5s", 
+    sn[0], xx, sn[1], xx+16, sn[2], xx+32);
+  info->_dirty = GL_TRUE;
+}
+
+
+//////////////////////////////////////////////////////////////////
+
+// RENDER WORKERS
+// -j N renders disjoint shards in N headless copies of this process,
+// each reports on its stdout and the parent merges the counters
+
+typedef struct worker_s {
+  PROCESS_INFORMATION process;
+  HANDLE pipe;         // read end of worker stdout
+  SDL_Thread *reader;
+  SDL_atomic_t frames; // shard size, -1 until reported
+  SDL_atomic_t done;
+} worker_t;
+
+
+int worker_reader(void *user) {
+  worker_t *w = user;
+  char buffer[256], line[256];
+  int used = 0, value;
+  DWORD size;
+  while (ReadFile(w->pipe, buffer, sizeof(buffer), &size, NULL) && size > 0) {
+    for (DWORD n = 0; n < size; n++) {
+      if (buffer[n] == '\r') continue;
+      if (buffer[n] != '\n') {
+        if (used < sizeof(line) - 1) line[used++] = buffer[n];
+        continue;
       }
-      free(frame_buf);
-      free(flipped_buf);
-      dispose_code_block(cblock);
-      for (int n = 0; n < num_frames; n++) { 
-        fclose(out_file[n]);
+      line[used] = 0;
+      used = 0;
+      if (sscanf(line, "frames %d", &value) == 1) SDL_AtomicSet(&(w->frames), value);
+      else if (sscanf(line, "frame %d", &value) == 1) SDL_AtomicAdd(&(w->done), 1);
+      else fprintf(stderr, "%s\n", line); // shader logs and the like
+    }
+  }
+  return 0;
+}
+
+void print_progress(worker_t *workers, int num_workers) {
+  int done = 0, total = 0;
+  for (int n = 0; n < num_workers; n++) {
+    done += SDL_AtomicGet(&(workers[n].done));
+    total += SDL_AtomicGet(&(workers[n].frames)) > 0 ? SDL_AtomicGet(&(workers[n].frames)) : 0;
+  }
+  fprintf(stderr, "\rrendered %d/%d frames", done, total);
+}
+
+// same command line with --shard i/N, cores are split between workers
+void run_workers(int argc, char **argv, int num_workers) {
+  char exe[MAX_PATH];
+  if (GetModuleFileNameA(NULL, exe, MAX_PATH) == 0)
+    __bad("start workers", "no executable path");
+  int threads = SDL_GetCPUCount() / num_workers - 1;
+  if (threads < 1) threads = 1;
+  
+  worker_t *workers = calloc(num_workers, sizeof(worker_t));
+  for (int i = 0; i < num_workers; i++) {
+    char command[4096];
+    int size = snprintf(command, sizeof(command), "\"%s\"", exe);
+    for (int n = 1; n < argc; n++) {
+      const char *skip[] = { "-j", "--shard", "--preview-every", "--progress" };
+      int k = 0;
+      while (k < 4 && strcmp(argv[n], skip[k])) k++;
+      if (k < 4) {
+        n += k < 3; // skip value as well
+        continue;
+      }
+      size += snprintf(command + size, sizeof(command) - size, " \"%s\"", argv[n]);
+    }
+    size += snprintf(command + size, sizeof(command) - size, " --shard %d/%d --progress", i, num_workers);
+    if (argument_pos(argc, argv, "-t") == 0) {
+      size += snprintf(command + size, sizeof(command) - size, " -t %d", threads);
+    }
+    if (size >= sizeof(command))
+      __bad("start workers", "command line too long");
+    
+    SECURITY_ATTRIBUTES inherit = { sizeof(inherit), NULL, TRUE };
+    HANDLE write;
+    if (!CreatePipe(&(workers[i].pipe), &write, &inherit, 0))
+      __bad("start workers", "create pipe failed");
+    SetHandleInformation(workers[i].pipe, HANDLE_FLAG_INHERIT, 0);
+    STARTUPINFOA startup = { .cb = sizeof(startup), .dwFlags = STARTF_USESTDHANDLES };
+    startup.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+    startup.hStdOutput = write;
+    startup.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+    if (!CreateProcessA(exe, command, NULL, NULL, TRUE, 0, NULL, NULL, &startup, &(workers[i].process)))
+      __bad("start worker", command);
+    CloseHandle(write);
+    SDL_AtomicSet(&(workers[i].frames), -1);
+    workers[i].reader = SDL_CreateThread(worker_reader, "worker", &workers[i]);
+  }
+  
+  for (bool running = true; running; ) {
+    running = false;
+    for (int n = 0; n < num_workers; n++) {
+      running |= WaitForSingleObject(workers[n].process.hProcess, 0) == WAIT_TIMEOUT;
+    }
+    print_progress(workers, num_workers);
+    if (running) SDL_Delay(250);
+  }
+  int failed = 0;
+  for (int n = 0; n < num_workers; n++) {
+    DWORD code = 1;
+    SDL_WaitThread(workers[n].reader, NULL);
+    GetExitCodeProcess(workers[n].process.hProcess, &code);
+    failed += code != 0;
+    CloseHandle(workers[n].process.hProcess);
+    CloseHandle(workers[n].process.hThread);
+    CloseHandle(workers[n].pipe);
+  }
+  print_progress(workers, num_workers);
+  fprintf(stderr, "\n");
+  free(workers);
+  int out_arg = argument_pos(argc, argv, "-o");
+  if (out_arg > 0) {
+    char path[128] = {0}, name[128] = {0};
+    split_path(argv[out_arg + 1], path, name);
+    merge_manifests(path, name, num_workers);
+  }
+  if (failed)
+    __bad("run workers", "some shards failed, see messages above");
+}
+
+
+// EXPORT JOB
+// one export is created (options, programs, output), run (render and
+// readback) and finished (encoders drained, output closed), a batch creates
+// the next export before it finishes the previous one
+
+typedef struct export_s {
+  int width, height;              // of one frame or sweep cell
+  int image_width, image_height;  // of an exported image
+  int band;
+  sweep_t sweep;
+  bool sweeping, sheet;
+  int preview_every;
+  code_block_t cblock;
+  float start, delta;             // time of frame n is start + delta * n
+  int first, last;
+  GLenum sample_type;
+  int num_threads;
+  int num_slots;                  // readback slots, frames in flight
+  int write_behind;
+  size_t direct_min;
+  readback_t readback;
+  output_t output;
+  timing_t timing;
+  exposure_t exposure;
+  int num_bands;
+  int num_missing;
+  pipeline_t pipeline;
+  bool encoding;                  // pipeline runs until finish_export
+  const char *stats;
+} export_t;
+
+
+// offscreen of the previous export is kept when its size and format match
+void prepare_offscreen(offscreen_t *off, int width, int height, GLenum format, bool depth, bool quantize) {
+  if (off->wh[0] != width || off->wh[1] != height || off->format != format || off->depth != depth) {
+    if (off->fb[0]) dispose_offscreen(*off);
+    *off = create_offscreen(width, height, format, depth);
+  }
+  if (quantize) enable_quantize(*off);
+}
+
+export_t* create_export(int argc, char **argv, offscreen_t *off) {
+  export_t *ex = calloc(1, sizeof(export_t));
+  int shader_path = argument_pos(argc, argv, "-f");
+  if (shader_path == 0)
+    __bad("get shader path", "use -h for help");
+  int out_arg = argument_pos(argc, argv, "-o");
+  if (out_arg == 0)
+    __bad("output animation", "use -h for help");
+  
+  ex->width = 600;
+  ex->height = 600;
+  int size_arg = argument_pos(argc, argv, "-x");
+  if (size_arg > 0) {
+    sscanf(argv[size_arg + 1], "%d,%d", &ex->width, &ex->height);
+  }
+  int preview_arg = argument_pos(argc, argv, "--preview-every");
+  if (preview_arg > 0) {
+    sscanf(argv[preview_arg + 1], "%d", &ex->preview_every);
+  }
+  
+  // sweep cells are frames that share one time
+  int anim_arg = argument_pos(argc, argv, "-a");
+  int sweep_arg = argument_pos(argc, argv, "--sweep");
+  int anim_fps = 1, num_frames = 0;
+  float duration = 0;
+  if (anim_arg > 0 && sweep_arg > 0)
+    __bad("set sweep", "-a and --sweep exclude each other");
+  if (anim_arg > 0) {
+    sscanf(argv[anim_arg + 1], "%d,%f", &anim_fps, &duration);
+    num_frames = floor(anim_fps * duration);
+  } else if (sweep_arg > 0) {
+    ex->sweeping = true;
+    ex->sweep = parse_sweep(argv[sweep_arg + 1], ex->width, ex->height);
+    ex->sheet = argument_pos(argc, argv, "--sheet") > 0;
+    num_frames = ex->sheet ? 1 : ex->sweep.num_cells;
+    int time_arg = argument_pos(argc, argv, "--time");
+    if (time_arg > 0) {
+      sscanf(argv[time_arg + 1], "%f", &ex->start);
+    }
+  } else {
+    __bad("output animation", "use -a or --sweep");
+  }
+  ex->image_width = ex->sheet ? ex->width * ex->sweep.columns : ex->width;
+  ex->image_height = ex->sheet ? ex->height * ex->sweep.rows : ex->height;
+  
+  // offscreen holds one band of a tiled export
+  int band_arg = argument_pos(argc, argv, "--band");
+  if (band_arg > 0) {
+    if (ex->sheet)
+      __bad("render bands", "--band and --sheet exclude each other");
+    sscanf(argv[band_arg + 1], "%d", &ex->band);
+    if (ex->band < 1 || ex->band > ex->height) ex->band = ex->height;
+    ex->preview_every = 0;
+  }
+  
+  ex->cblock = load_shader_code(argv[shader_path + 1]);
+  if (pgset.comp) glDeleteProgram(pgset.comp);
+  pgset.comp = 0;
+  if (ex->cblock.comp) {
+    pgset.comp = create_program(NULL, NULL, (const char**)&(ex->cblock.comp));
+    update_compute_buffer(&pgset, ex->cblock.comp_opts.item_size, ex->cblock.comp_opts.num_items);
+  }
+  if (pgset.frag) glDeleteProgram(pgset.frag);
+  pgset.frag = create_program(&bypass_vert, (const char**)&(ex->cblock.frag), NULL);
+  if (pgset.frag == 0)
+    __bad("compile shader", argv[shader_path + 1]);
+  glProgramUniform2i(pgset.frag, 3, ex->width, ex->height);
+  if (screen_quad.root) dispose_shape(screen_quad);
+  screen_quad = gen_quad(
+    (point_t){-1, 1, 0},
+    (point_t){1, -1, 0},
+    scale_ndc((point_t){-1, 1, 0}, ex->width, ex->height),
+    scale_ndc((point_t){1, -1, 0}, ex->width, ex->height));
+  
+  int format = OUTPUT_PNG;
+  int format_arg = argument_pos(argc, argv, "--format");
+  if (format_arg > 0) {
+    const char *formats[] = { "png", "y4m", "pam", "apng", "exr" };
+    for (format = 0; format < 5 && strcmp(argv[format_arg + 1], formats[format]); format++);
+    if (format == 5)
+      __bad("set output format", argv[format_arg + 1]);
+  }
+  
+  int depth = 16;
+  int depth_arg = argument_pos(argc, argv, "--depth");
+  if (depth_arg > 0) {
+    sscanf(argv[depth_arg + 1], "%d", &depth);
+  }
+  if (format == OUTPUT_EXR ? depth != 16 && depth != 32 : depth != 8 && depth != 16)
+    __bad("set bit depth", format == OUTPUT_EXR ? "use 16 (half) or 32 (float)" : "use 8 or 16");
+  
+  // 8 bit frames are quantized on GPU, readback and deflate input halve,
+  // EXR keeps the unclamped range of the float target
+  ex->sample_type = GL_UNSIGNED_SHORT;
+  if (format == OUTPUT_EXR) {
+    ex->sample_type = depth == 32 ? GL_FLOAT : GL_HALF_FLOAT;
+  }
+  int dither = 0;
+  if (depth == 8) {
+    dither = 1;
+    int dither_arg = argument_pos(argc, argv, "--dither");
+    if (dither_arg > 0) {
+      const char *modes[] = { "none", "ordered", "noise" };
+      for (dither = 0; dither < 3 && strcmp(argv[dither_arg + 1], modes[dither]); dither++);
+      if (dither == 3)
+        __bad("set dither", argv[dither_arg + 1]);
+    }
+    if (!pgset.quant) pgset.quant = create_program(&bypass_vert, &quant_frag, NULL);
+    glProgramUniform1i(pgset.quant, 0, dither);
+    ex->sample_type = GL_UNSIGNED_BYTE;
+  } else if (pgset.quant) {
+    // readback takes whichever target was drawn last
+    glDeleteProgram(pgset.quant);
+    pgset.quant = 0;
+  }
+  ex->num_threads = SDL_GetCPUCount() - 1;
+  int threads_arg = argument_pos(argc, argv, "-t");
+  if (threads_arg > 0) {
+    sscanf(argv[threads_arg + 1], "%d", &ex->num_threads);
+  }
+  if (ex->num_threads < 1) ex->num_threads = 1;
+  
+  // every frame in flight owns one persistently mapped readback slot, two
+  // per encoder while they fit the budget, frames too large for two slots
+  // are rendered in bands where the output allows it
+  int budget_mb = 1024;
+  int budget_arg = argument_pos(argc, argv, "--readback-mb");
+  if (budget_arg > 0) {
+    sscanf(argv[budget_arg + 1], "%d", &budget_mb);
+  }
+  size_t budget = (size_t)(budget_mb > 0 ? budget_mb : 1) << 20;
+  size_t row_size = depth / 8 * ex->image_width * 4;
+  size_t frame_size = row_size * ex->image_height;
+  ex->num_slots = ex->num_threads * 2 + 2;
+  if (ex->num_slots > budget / frame_size) ex->num_slots = budget / frame_size;
+  if (ex->num_slots < 2) {
+    ex->num_slots = 2;
+    const char *ext = strrchr(argv[out_arg + 1], '.');
+    bool png_files = format == OUTPUT_PNG && !(ext && strcmp(ext, ".zip") == 0);
+    if (!ex->band && !ex->sheet && png_files) {
+      ex->band = budget / (READBACK_AHEAD * row_size);
+      if (ex->band < 1) ex->band = 1;
+      ex->preview_every = 0;
+      fprintf(stderr, "frames exceed --readback-mb %d, rendering bands of %d rows\n", budget_mb, ex->band);
+    }
+  }
+  
+  GLenum precision = parse_precision(argc, argv);
+  prepare_offscreen(off, ex->image_width, ex->band ? ex->band : ex->image_height, precision,
+    argument_pos(argc, argv, "--depth-stencil") > 0, depth == 8);
+  
+  // supersampling averages jittered passes on GPU, readback stays one sample
+  int ssaa = 1;
+  int ssaa_arg = argument_pos(argc, argv, "--ssaa");
+  if (ssaa_arg > 0) {
+    sscanf(argv[ssaa_arg + 1], "%d", &ssaa);
+    if (ssaa < 1) ssaa = 1;
+  }
+  // motion blur averages subframes over a part of the frame interval
+  int blur = 1;
+  float shutter = 0.5;
+  int blur_arg = argument_pos(argc, argv, "--blur");
+  if (blur_arg > 0) {
+    sscanf(argv[blur_arg + 1], "%d,%f", &blur, &shutter);
+    if (blur < 1) blur = 1;
+  }
+  
+  struct spng_ihdr ihdr = {
+    .color_type = SPNG_COLOR_TYPE_TRUECOLOR_ALPHA,
+    .height = ex->image_height,
+    .width = ex->image_width,
+    .bit_depth = depth,
+  };
+  
+  ex->delta = num_frames > 1 ? duration / (num_frames-1) : 0;
+  
+  // a part of the animation, frame n keeps time delta * n and file name
+  ex->first = 0;
+  ex->last = num_frames;
+  int frames_arg = argument_pos(argc, argv, "--frames");
+  if (frames_arg > 0) {
+    sscanf(argv[frames_arg + 1], "%d:%d", &ex->first, &ex->last);
+  }
+  if (ex->first < 0) ex->first = 0;
+  if (ex->last > num_frames) ex->last = num_frames;
+  if (ex->first > ex->last)
+    __bad("set frame range", argv[frames_arg + 1]);
+  int shard = 0, num_shards = 1;
+  int shard_arg = argument_pos(argc, argv, "--shard");
+  if (shard_arg > 0) {
+    sscanf(argv[shard_arg + 1], "%d/%d", &shard, &num_shards);
+    if (num_shards < 1 || shard < 0 || shard >= num_shards)
+      __bad("set shard", argv[shard_arg + 1]);
+    int span = ex->last - ex->first;
+    ex->last = ex->first + span * (shard + 1) / num_shards;
+    ex->first = ex->first + span * shard / num_shards;
+  }
+  ex->write_behind = 1;
+  int write_arg = argument_pos(argc, argv, "-w");
+  if (write_arg > 0) {
+    sscanf(argv[write_arg + 1], "%d", &ex->write_behind);
+  }
+  int direct_arg = argument_pos(argc, argv, "--direct");
+  if (direct_arg > 0) {
+    int direct_mb = 0;
+    sscanf(argv[direct_arg + 1], "%d", &direct_mb);
+    ex->direct_min = (size_t)direct_mb << 20;
+  }
+  
+  ex->readback = ex->band
+    ? create_readback(READBACK_AHEAD, row_size * ex->band)
+    : create_readback(ex->num_slots, frame_size);
+  output_t *output = &ex->output;
+  *output = open_output(argv[out_arg + 1], format, ihdr, anim_fps, ex->last - ex->first, ex->num_slots);
+  if (ex->band && (format != OUTPUT_PNG || output->zip))
+    __bad("render bands", "--band needs png files");
+  output->next = ex->first;
+  int speed_arg = argument_pos(argc, argv, "--png-speed");
+  if (speed_arg > 0) {
+    const char *speeds[] = { "balanced", "draft", "archive" };
+    for (output->png_speed = 0; output->png_speed < 3 && strcmp(argv[speed_arg + 1], speeds[output->png_speed]); output->png_speed++);
+    if (output->png_speed == 3)
+      __bad("set png speed", argv[speed_arg + 1]);
+  }
+  if ((format == OUTPUT_PNG || format == OUTPUT_EXR) && !output->zip) {
+    // files of an earlier run with same code and settings are kept
+    char settings[128];
+    int size = sprintf(settings, "%d %d %d %d %d %d %d %g %x", ex->width, ex->height, format, depth, dither, ssaa, blur, shutter * ex->delta, precision);
+    uint64_t hash = hash_bytes(HASH_SEED, settings, size);
+    if (ex->sweeping) {
+      hash = hash_bytes(hash, argv[sweep_arg + 1], strlen(argv[sweep_arg + 1]) + 1);
+      size = sprintf(settings, "%g %d", ex->start, ex->sheet);
+      hash = hash_bytes(hash, settings, size);
+    }
+    char *blocks[] = { ex->cblock.frag, ex->cblock.comp, ex->cblock.vert };
+    for (int n = 0; n < 3; n++) {
+      if (blocks[n]) hash = hash_bytes(hash, blocks[n], strlen(blocks[n]) + 1);
+    }
+    output->cache_hash = hash;
+    size = sprintf(settings, "%d %g", anim_fps, duration);
+    open_manifest(output, hash_bytes(hash, settings, size), ex->delta, num_frames, ex->first, ex->last, shard_arg > 0 ? shard : -1);
+    
+    // same pixels at the same time from any earlier export are linked in
+    int cache_arg = argument_pos(argc, argv, "--cache");
+    if (cache_arg > 0 && ex->sweeping && !ex->sheet)
+      __bad("set cache", "sweep cells share one time, cache them as --sheet");
+    if (cache_arg > 0) {
+      snprintf(output->cache, sizeof(output->cache), "%s", argv[cache_arg + 1]);
+      drill_path(output->cache);
+      for (int n = ex->first; n < ex->last; n++) {
+        if (!output->present[n]) output_restore(output, n);
+      }
+    }
+    output_skip(output);
+  }
+  for (int n = ex->first; n < ex->last; n++) {
+    ex->num_missing += !(output->present && output->present[n]);
+  }
+  if (argument_pos(argc, argv, "--progress") > 0) {
+    if (output->stream == stdout)
+      __bad("report progress", "stdout is taken by output");
+    output->progress = stdout;
+    printf("frames %d\n", ex->num_missing);
+    fflush(stdout);
+  }
+  int stats_arg = argument_pos(argc, argv, "--stats");
+  ex->stats = stats_arg > 0 ? argv[stats_arg + 1] : NULL;
+  if (!output->progress) fprintf(stderr, "start animation rendering of %s (%d of %d frames)\n", argv[out_arg + 1], ex->num_missing, ex->last - ex->first);
+  
+  ex->timing = create_timing(ex->first, ex->last - ex->first, ex->readback.num_slots);
+  output->timing = &ex->timing;
+  ex->num_bands = ex->band ? (ex->height + ex->band - 1) / ex->band : 1;
+  ex->exposure = (exposure_t){ create_quads(ex->width, ex->height, ex->band ? ex->band : ex->height, ex->num_bands, ssaa), ssaa * ssaa, blur, shutter * ex->delta };
+  return ex;
+}
+
+// returns once every frame is read back, encoders may still be busy
+void run_export(export_t *ex, offscreen_t off, SDL_Window *window) {
+  output_t *output = &ex->output;
+  if (ex->band) {
+    for (int n = ex->first; n < ex->last; n++) {
+      if (output->present && output->present[n]) continue;
+      if (ex->sweeping) apply_sweep(&ex->sweep, n);
+      render_bands(output, off, &ex->readback, ex->exposure, ex->num_bands, n, ex->start + ex->delta * n, ex->sample_type);
+    }
+    return;
+  }
+  
+  pipeline_t *pipeline = &ex->pipeline;
+  if (ex->write_behind == 2 && (output->format == OUTPUT_PNG || output->format == OUTPUT_EXR) && !output->zip) {
+    start_async_writes(output, ex->direct_min);
+  }
+  start_pipeline(pipeline, output, &ex->readback, ex->num_threads, ex->write_behind == 1 || (ex->write_behind == 2 && !output->port));
+  ex->encoding = true;
+  
+  // frame N is handed to encoders while frames N+1.. are still in flight on GPU
+  // one slot stays free for the frame an encoder or the writer still holds
+  frame_t *ahead[READBACK_AHEAD];
+  int ahead_head = 0, ahead_count = 0;
+  int ahead_max = ex->num_slots - 1 < READBACK_AHEAD ? ex->num_slots - 1 : READBACK_AHEAD;
+  for (int n = ex->first, done = ex->first; done < ex->last; ) {
+    if (n < ex->last && output->present && output->present[n]) {
+      n++;
+      done++;
+      continue;
+    }
+    if (n < ex->last && ahead_count < ahead_max) {
+      frame_t *frame = pipeline_acquire(pipeline, n);
+      glBeginQuery(GL_TIME_ELAPSED, ex->timing.queries[frame->slot]);
+      if (ex->sheet) {
+        render_sheet(off, ex->exposure, &ex->sweep, ex->start);
+      } else {
+        if (ex->sweeping) apply_sweep(&ex->sweep, n);
+        float time = ex->start + ex->delta * n;
+        begin_exposure(ex->exposure, time);
+        render_export(off, ex->exposure, 0, time);
+        end_exposure(ex->exposure, time);
+      }
+      glEndQuery(GL_TIME_ELAPSED);
+      uint64_t start = SDL_GetPerformanceCounter();
+      readback_push(&ex->readback, frame->slot, ex->image_width, ex->image_height, GL_RGBA, ex->sample_type);
+      timing_add(&ex->timing, STAGE_READBACK, n, elapsed_ms(start));
+      if (ex->preview_every > 0 && n % ex->preview_every == 0) {
+        present_content(off);
+        SDL_GL_SwapWindow(window);
+        SDL_PumpEvents();
+      }
+      ahead[(ahead_head + ahead_count++) % READBACK_AHEAD] = frame;
+      n++;
+      continue;
+    }
+    frame_t *frame = ahead[ahead_head];
+    ahead_head = (ahead_head + 1) % READBACK_AHEAD;
+    ahead_count--;
+    uint64_t start = SDL_GetPerformanceCounter();
+    readback_wait(&ex->readback, frame->slot);
+    timing_add(&ex->timing, STAGE_READBACK, frame->index, elapsed_ms(start));
+    timing_gpu(&ex->timing, frame->slot, frame->index);
+    queue_push(&pipeline->encode, frame);
+    done++;
+  }
+}
+
+void finish_export(export_t *ex) {
+  if (ex->encoding) finish_pipeline(&ex->pipeline);
+  for (int n = 0; n < ex->num_bands * ex->exposure.samples; n++) dispose_shape(ex->exposure.quads[n]);
+  free(ex->exposure.quads);
+  close_output(ex->output);
+  dispose_readback(ex->readback);
+  dispose_code_block(ex->cblock);
+  if (!ex->output.progress) {
+    fprintf(stderr, "... done (%d frames).\n", ex->num_missing);
+    report_timing(&ex->timing, ex->stats);
+  }
+  dispose_timing(ex->timing);
+  free(ex);
+}
+
+// previous job of a batch, its encoders drain while the next job is set up
+static export_t *draining = NULL;
+
+void finish_draining(void) {
+  bad_hook = NULL;
+  finish_export(draining);
+  draining = NULL;
+}
+
+// one job per line, written as command line options, options given next to
+// --batch apply to every job unless the line sets them, # starts a comment
+void run_batch(int argc, char **argv, int batch_arg, offscreen_t *off, SDL_Window *window) {
+  char *text = read_text(argv[batch_arg + 1]);
+  if (text == NULL)
+    __bad("read batch file", argv[batch_arg + 1]);
+  // a line has at most one token per two characters
+  char **args = malloc((strlen(text) / 2 + 2 + argc) * sizeof(char*));
+  export_t *prev = NULL;
+  for (char *line = text; line && *line; ) {
+    char *end = strchr(line, '\n');
+    if (end) *end = 0;
+    int num_args = 0;
+    args[num_args++] = argv[0];
+    for (char *p = line; ; ) {
+      while (isspace(*p)) p++;
+      if (*p == 0 || *p == '#') break;
+      bool quoted = *p == '"';
+      p += quoted;
+      args[num_args++] = p;
+      while (*p && (quoted ? *p != '"' : !isspace(*p))) p++;
+      if (*p == 0) break;
+      *p++ = 0;
+    }
+    if (num_args > 1) {
+      for (int n = 1; n < argc; n++) {
+        if (n != batch_arg && n != batch_arg + 1) args[num_args++] = argv[n];
+      }
+      // stdout takes one stream at a time, output and progress lines of two
+      // jobs must not interleave
+      int out_arg = argument_pos(num_args, args, "-o");
+      if (prev && (prev->output.stream == stdout || (out_arg > 0 && strcmp(args[out_arg + 1], "-") == 0))) {
+        finish_export(prev);
+        prev = NULL;
       }
-      printf("... done (%d frames).\n", num_frames);        
+      // next job compiles while encoders of the previous one drain, a bad
+      // line finishes the previous job before it exits
+      draining = prev;
+      bad_thread = SDL_ThreadID();
+      bad_hook = prev ? finish_draining : NULL;
+      export_t *ex = create_export(num_args, args, off);
+      bad_hook = NULL;
+      draining = NULL;
+      if (prev) finish_export(prev);
+      run_export(ex, *off, window);
+      prev = ex;
+    }
+    line = end ? end + 1 : "";
+  }
+  if (prev) finish_export(prev);
+  free(args);
+  free(text);
+}
+
+
+int main(int argc, char **argv) {
+  if (argument_pos(argc, argv, "-h") > 0) {
+    printf("%s", usage);
+    return 0;
+  }
+  int batch_arg = argument_pos(argc, argv, "--batch");
+  int shader_path = argument_pos(argc, argv, "-f");
+  if (shader_path > 0) {
+    shader_path += 1;  
+  } else if (batch_arg == 0) {
+    __bad("get shader path", "use -h for help");
+  }
+  
+  int width = 600, height = 600, delay = 20;
+  int size_arg = argument_pos(argc, argv, "-x");
+  if (size_arg > 0) {
+    sscanf(argv[size_arg + 1], "%d,%d", &width, &height);
+  }
+  int delay_arg = argument_pos(argc, argv, "-d");
+  if (delay_arg > 0) {
+    sscanf(argv[delay_arg + 1], "%d", &delay);
+  }
+  
+  
+  // export renders as fast as possible, window is shown only for preview
+  int anim_arg = argument_pos(argc, argv, "-a");
+  int preview_every = 0;
+  int preview_arg = argument_pos(argc, argv, "--preview-every");
+  if (preview_arg > 0) {
+    sscanf(argv[preview_arg + 1], "%d", &preview_every);
+  }
+  int sweep_arg = argument_pos(argc, argv, "--sweep");
+  bool sheet = sweep_arg > 0 && argument_pos(argc, argv, "--sheet") > 0;
+  bool exporting = anim_arg > 0 || sweep_arg > 0 || batch_arg > 0;
+  export_errors = exporting;
+  int jobs_arg = argument_pos(argc, argv, "-j");
+  if (exporting && !sheet && batch_arg == 0 && jobs_arg > 0) {
+    int num_jobs = 1;
+    sscanf(argv[jobs_arg + 1], "%d", &num_jobs);
+    int format_arg = argument_pos(argc, argv, "--format");
+    int out_arg = argument_pos(argc, argv, "-o");
+    const char *ext = out_arg > 0 ? strrchr(argv[out_arg + 1], '.') : NULL;
+    if ((format_arg > 0 && strcmp(argv[format_arg + 1], "png") && strcmp(argv[format_arg + 1], "exr")) || (ext && strcmp(ext, ".zip") == 0))
+      __bad("run workers", "-j needs png or exr files");
+    if (num_jobs > 1) {
+      run_workers(argc, argv, num_jobs);
+      return 0;
+    }
+  }
+  int band = 0;
+  int band_arg = argument_pos(argc, argv, "--band");
+  if (exporting && band_arg > 0) {
+    sscanf(argv[band_arg + 1], "%d", &band);
+    if (band < 1 || band > height) band = height;
+    preview_every = 0;
+  }
+  uint32_t window_flags = exporting && preview_every <= 0 ? SDL_WINDOW_HIDDEN : SHOWN;
+  SDL_Window* window = create_window(width, band ? band : height, window_flags, exporting ? 0 : 1);
+  pgset.post = create_program(&bypass_vert, &post_frag, NULL);
+  
+  // ANIMATION BATCH //
+
+  if (exporting) {
+    // context, programs and offscreen are shared by all jobs of a batch
+    offscreen_t offscr = { 0 };
+    if (batch_arg > 0) {
+      run_batch(argc, argv, batch_arg, &offscr, window);
     } else {
-      __bad("output animation", "use -h for help");
+      export_t *ex = create_export(argc, argv, &offscr);
+      run_export(ex, offscr, window);
+      finish_export(ex);
     }
+    if (offscr.fb[0]) dispose_offscreen(offscr);
     dispose_program_set(pgset);
     dispose_shape(screen_quad);
     dispose_window(window);
     return 0;
   }
+  
+  offscreen_t offscr = create_offscreen(width, height, parse_precision(argc, argv), argument_pos(argc, argv, "--depth-stencil") > 0);
+  screen_quad = gen_quad(  
+    (point_t){-1, 1, 0}, 
+    (point_t){1, -1, 0}, 
+    scale_ndc((point_t){-1, 1, 0}, width, height), 
+    scale_ndc((point_t){1, -1, 0}, width, height));
 
   // INTERACTIVE AND PERSISTENT //
   